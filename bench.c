@@ -0,0 +1,338 @@
+/* benchmark of the download path: requests tiles through gettile()
+ * like the display does, and measures how long each one takes to show up
+ * use it with the local mock server: make bench */
+
+#define BENCH_TILES 1000
+
+int bench_cmp(const void *a, const void *b)
+{
+	return *(int *) a - *(int *) b;
+}
+
+/* download (n) new tiles of view (v) at zoom (zoom), (window) at the same time */
+void bench(int n, int v, int zoom)
+{
+	int *start, *latency;
+	int i, side, started = 0, done = 0, failed = 0, low = 0, window, t0, now;
+	int x0, y0, max = 1 << (17 - zoom);
+	SDL_Surface *tile;
+
+	/* without a disk cache, neither read nor written, every tile goes through the network */
+	config.cache_size = 0;
+	config.lookahead = 0;
+	window = config.transfers * 2 > MEMORY_CACHE_SIZE / 2 ? MEMORY_CACHE_SIZE / 2 : config.transfers * 2;
+
+	/* a square of new tiles, somewhere in the world */
+	for (side = 1; side * side < n; side++);
+	if (side > max) side = max;
+	if (n > side * side) n = side * side;
+	srand(time(NULL));
+	x0 = max > side ? rand() % (max - side) : 0;
+	y0 = max > side ? rand() % (max - side) : 0;
+
+	start = malloc(sizeof(int) * n);
+	latency = malloc(sizeof(int) * n);
+	printf("bench: %d tiles of %s at zoom %d, %d transfers\n", n, _view[v], 17 - zoom, config.transfers);
+
+	t0 = SDL_GetTicks();
+	while (done < n)
+	{
+		now = SDL_GetTicks();
+		while (started < n && started - done < window)
+		{
+			start[started] = now;
+			latency[started] = -1;
+			if ((tile = gettile(x0 + started % side, y0 + started / side, zoom, v)) != NULL)
+			{
+				/* the n/a image: it failed before */
+				if (tile == na)
+					failed++;
+				latency[started] = 0;
+				done++;
+			}
+			started++;
+		}
+
+		receivetiles();
+
+		/* check the tiles that arrived, or failed */
+		now = SDL_GetTicks();
+		for (i = low; i < started; i++)
+			if (latency[i] < 0)
+			{
+				if (getmemory(x0 + i % side, y0 + i / side, zoom, v) == NULL)
+				{
+					if (!net_failing(x0 + i % side, y0 + i / side, zoom, v))
+						continue;
+					failed++;
+				}
+				latency[i] = now - start[i];
+				done++;
+			}
+		while (low < started && latency[low] >= 0) low++;
+		SDL_Delay(1);
+	}
+	now = SDL_GetTicks();
+
+	qsort(latency, n, sizeof(int), bench_cmp);
+	printf("bench: %d tiles in %.2f s, %.1f tiles/s, p50 %d ms, p99 %d ms, %d failed\n",
+		n, (now - t0) / 1000.0, n * 1000.0 / (now - t0 ? now - t0 : 1),
+		latency[n / 2], latency[n * 99 / 100], failed);
+	printf("bench: %d connections opened, %d reused, %d KB\n",
+		net_stats.opened, net_stats.reused, net_stats.bytes[PRIO_VISIBLE] / 1024);
+
+	free(start);
+	free(latency);
+}
+
+/* the disk cache lookup before the index, for comparison */
+int bench_linear(int x, int y, int z, int s)
+{
+	int i;
+	for (i = 0; i < config.cache_size; i++)
+		if (disk[i].x == x && disk[i].y == y && disk[i].z == z && disk[i].s == s)
+			return i;
+	return -1;
+}
+
+/* microbenchmark of the disk cache index, the lookups should not depend on the cache size */
+#define BENCH_LOOKUPS 1000000
+#define BENCH_SCANS 200
+
+void bench_index()
+{
+	struct _disk *saved = disk;
+	int sizes[] = {1600, 25600, 409600, 3276800};
+	int saved_size = config.cache_size, *picks, i, k, n, t, found;
+	float hit, miss, scan;
+
+	/* the compaction must not look at the fake entries */
+	pack_quit();
+	picks = malloc(sizeof(int) * BENCH_LOOKUPS);
+	for (k = 0; k < sizeof(sizes) / sizeof(int); k++)
+	{
+		/* a full cache of different tiles */
+		n = config.cache_size = sizes[k];
+		disk = calloc(n, sizeof(struct _disk));
+		for (i = 0; i < n; i++)
+		{
+			disk[i].x = i % 4096;
+			disk[i].y = i / 4096;
+			disk[i].z = i % 7;
+			disk[i].s = i % 5;
+			disk[i].fetched = 1;
+		}
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			picks[i] = ((unsigned int) rand() * RAND_MAX + rand()) % n;
+
+		t = SDL_GetTicks();
+		diskindex_build();
+		printf("index: %7d entries, built in %d ms", n, SDL_GetTicks() - t);
+
+		found = 0;
+		t = SDL_GetTicks();
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			found += indisk(disk[picks[i]].x, disk[picks[i]].y, disk[picks[i]].z, disk[picks[i]].s) == picks[i];
+		hit = (SDL_GetTicks() - t) * 1e6 / BENCH_LOOKUPS;
+
+		t = SDL_GetTicks();
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			found += indisk(disk[picks[i]].x, disk[picks[i]].y + 4096, disk[picks[i]].z, disk[picks[i]].s) >= 0;
+		miss = (SDL_GetTicks() - t) * 1e6 / BENCH_LOOKUPS;
+
+		t = SDL_GetTicks();
+		for (i = 0; i < BENCH_SCANS; i++)
+			found += bench_linear(disk[picks[i]].x, disk[picks[i]].y, disk[picks[i]].z, disk[picks[i]].s) == picks[i];
+		scan = (SDL_GetTicks() - t) * 1e6 / BENCH_SCANS;
+
+		printf(", hit %.0f ns, miss %.0f ns, linear scan %.0f ns%s\n", hit, miss, scan, found == BENCH_LOOKUPS + BENCH_SCANS ? "" : " (wrong results!)");
+		free(disk);
+	}
+	free(picks);
+
+	disk = saved;
+	config.cache_size = saved_size;
+	diskindex_build();
+}
+
+/* benchmark of the formats of the tiles on disk: their size, and the time to load one
+ * with the tiles of the disk cache, or the n/a image if it is empty
+ * the data is already in memory, as in the packs when they are mapped */
+#define BENCH_DISK_TILES 200
+#define BENCH_DISK_TIME 1000
+
+void bench_disk(int n)
+{
+	SDL_Surface *tile;
+	char **samples[PACK_FORMATS], *data;
+	int *sizes[PACK_FORMATS], num = 0, i, f, t, k, loaded, size, format, copy;
+	float bytes;
+
+	for (f = 0; f < PACK_FORMATS; f++)
+	{
+		samples[f] = calloc(n, sizeof(char *));
+		sizes[f] = calloc(n, sizeof(int));
+	}
+
+	/* the tiles of the disk cache, as they were downloaded */
+	disk_lock();
+	for (i = 0; i < config.cache_size && num < n; i++)
+		if (disk[i].fetched && (data = pack_data(i, &size, &format, &copy)) != NULL)
+		{
+			if (format == PACK_IMAGE)
+			{
+				samples[PACK_IMAGE][num] = malloc(size);
+				memcpy(samples[PACK_IMAGE][num], data, size);
+				sizes[PACK_IMAGE][num++] = size;
+			}
+			if (copy) free(data);
+		}
+	disk_unlock();
+	if (!num && (samples[PACK_IMAGE][0] = pack_load("data/na.png", &sizes[PACK_IMAGE][0])) != NULL)
+	{
+		printf("bench: no tile in the disk cache, with data/na.png\n");
+		num = 1;
+	}
+
+	/* the same tiles, decoded */
+	for (i = 0; i < num; i++)
+		if ((tile = loadtile(samples[PACK_IMAGE][i], sizes[PACK_IMAGE][i], PACK_IMAGE)) != NULL)
+		{
+			for (f = PACK_PIXELS; f < DISK_FORMATS; f++)
+				samples[f][i] = tilepixels(tile, f, &sizes[f][i]);
+			SDL_FreeSurface(tile);
+		}
+
+	printf("bench: %d tiles\n", num);
+	for (f = 0; f < DISK_FORMATS; f++)
+	{
+		bytes = loaded = k = 0;
+		for (i = 0; i < num; i++)
+			if (samples[f][i] != NULL)
+			{
+				bytes += sizes[f][i];
+				k++;
+			}
+		t = SDL_GetTicks();
+		while (SDL_GetTicks() - t < BENCH_DISK_TIME)
+			for (i = 0; i < num; i++)
+				if (samples[f][i] != NULL && (tile = loadtile(samples[f][i], sizes[f][i], f)) != NULL)
+				{
+					SDL_FreeSurface(tile);
+					loaded++;
+				}
+		if (loaded)
+			printf("bench: %-14s %7.1f KB per tile, %7.1f us to load a tile\n", _disk_format[f],
+				bytes / 1024 / k, (SDL_GetTicks() - t) * 1000.0 / loaded);
+		else
+			printf("bench: %-14s cannot load the tiles\n", _disk_format[f]);
+	}
+
+	for (f = 0; f < PACK_FORMATS; f++)
+	{
+		for (i = 0; i < num; i++)
+			free(samples[f][i]);
+		free(samples[f]);
+		free(sizes[f]);
+	}
+}
+
+/* the dedup check runs in a scratch cache, the one of the user is never touched */
+#define BENCH_SCRATCH "check.tmp"
+char bench_urls[256];
+
+/* delete the files of the scratch cache, from inside it */
+void bench_clean()
+{
+	char buf[100];
+	int p;
+
+	for (p = 0; p < MAX_PROVIDERS; p++)
+	{
+		sprintf(buf, "cache/pack.%.3d", p);
+		unlink(buf);
+	}
+	unlink("data/disk.idx");
+	unlink("data/disk.tmp");
+	unlink("data/disk.jnl");
+	unlink("data/disk.lck");
+	rmdir("cache");
+	rmdir("kml");
+	rmdir("data");
+}
+
+/* move to an empty scratch cache, before init_data() */
+int bench_scratch()
+{
+	mkdir(BENCH_SCRATCH, 0755);
+	if (chdir(BENCH_SCRATCH) != 0)
+	{
+		printf("dedup: no scratch folder %s\n", BENCH_SCRATCH);
+		return 0;
+	}
+	/* left by a check that did not end */
+	bench_clean();
+	mkdir("data", 0755);
+	/* the providers are still those of the user */
+	if (urls_file[0] != '/' && strchr(urls_file, ':') == NULL)
+	{
+		snprintf(bench_urls, sizeof(bench_urls), "../%s", urls_file);
+		urls_file = bench_urls;
+	}
+	return 1;
+}
+
+/* close the scratch cache and delete it, nothing is saved */
+void bench_unscratch()
+{
+	write_quit();
+	pack_quit();
+	index_close();
+	if (journal != NULL)
+		fclose(journal);
+	journal = NULL;
+	dat_loaded = 0;
+	bench_clean();
+	if (chdir("..") == 0)
+		rmdir(BENCH_SCRATCH);
+}
+
+/* check of the shared records (see dedup.c): tiles with the same bytes but different ETags
+ * share one record and must still send their own ETag, also after one of them changes
+ * the tiles are out of the map (y < 0), evicted at the end: the space used must be as before */
+void bench_dedup()
+{
+	char data[] = "the same bytes for every tile", etag[100];
+	char *etags[] = {"\"first\"", "\"second\"", "", "\"changed\""};
+	long long bytes, used;
+	int i, k, wrong = 0, shared = 0, p = net_provider[0];
+
+	if (config.cache_size < 4)
+	{
+		printf("dedup: the disk cache is too small\n");
+		return;
+	}
+	disk_lock();
+	bytes = pack_bytes;
+	used = pack_used[p];
+	/* three tiles, then the first one again with another ETag */
+	for (k = 0; k < 4; k++)
+		writedisk(k % 3, -1, 0, 0, data, sizeof(data), PACK_IMAGE, etags[k], 0);
+	for (k = 0; k < 3; k++)
+	{
+		if ((i = indisk(k, -1, 0, 0)) < 0)
+		{
+			wrong++;
+			continue;
+		}
+		pack_etag(i, etag);
+		wrong += strcmp(etag, etags[k ? k : 3]) != 0;
+		shared += dedup_of(i) != NULL;
+	}
+	for (k = 0; k < 3; k++)
+		if ((i = indisk(k, -1, 0, 0)) >= 0)
+			diskevict(i);
+	printf("dedup: %d tiles in a shared record, %d wrong ETags%s\n", shared, wrong,
+		pack_bytes == bytes && pack_used[p] == used ? "" : ", wrong space used!");
+	disk_unlock();
+}
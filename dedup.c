@@ -0,0 +1,128 @@
+/* deduplication of the disk cache: identical tiles (sea, sky, blank tiles of a provider)
+ * are stored once in the packs, and their entries point to the same record
+ * an entry has the hash of its content, the records are found by it in a table
+ * with the number of entries that use them: a record is dead when the last one goes
+ * the record holds the first tile: the others are checked against the table instead of its key */
+
+/* a record of the packs, used by (refs) entries */
+typedef struct
+{
+	unsigned int hash;
+	short pack;
+	int offset, length, refs;
+	/* where it was before the compaction moved it (-1 if it was not), the other entries follow it */
+	short from_pack;
+	int from_offset;
+} blob;
+
+/* open addressing on the hash, a free slot has no refs */
+blob *dedup_table = NULL;
+int dedup_mask;
+
+/* records, and the entries that use them */
+int dedup_blobs = 0, dedup_refs = 0;
+
+/* hash of the content of a tile, never 0 (no hash, as the entries of the previous versions) */
+unsigned int dedup_sum(char *data, int n)
+{
+	unsigned char *p = (unsigned char *) data;
+	unsigned int h = 2166136261U;
+	int k;
+
+	for (k = 0; k < n; k++)
+		h = (h ^ p[k]) * 16777619U;
+	return h ? h : 1;
+}
+
+/* returns the record of (hash) at (offset) of the pack (p), or NULL */
+blob *dedup_find(unsigned int hash, int p, int offset)
+{
+	int h;
+
+	for (h = tilehash(hash) & dedup_mask; dedup_table[h].refs; h = (h + 1) & dedup_mask)
+		if (dedup_table[h].hash == hash && dedup_table[h].pack == p && dedup_table[h].offset == offset)
+			return &dedup_table[h];
+	return NULL;
+}
+
+/* returns the record of (hash) moved from (offset) of the pack (p) by the compaction, or NULL */
+blob *dedup_moved(unsigned int hash, int p, int offset)
+{
+	int h;
+
+	for (h = tilehash(hash) & dedup_mask; dedup_table[h].refs; h = (h + 1) & dedup_mask)
+		if (dedup_table[h].hash == hash && dedup_table[h].from_pack == p && dedup_table[h].from_offset == offset)
+			return &dedup_table[h];
+	return NULL;
+}
+
+/* returns the record of the entry (i), where it is or where the compaction moved it, or NULL */
+blob *dedup_of(int i)
+{
+	blob *b;
+
+	if (!disk[i].hash)
+		return NULL;
+	if ((b = dedup_find(disk[i].hash, disk[i].pack, disk[i].offset)) == NULL)
+		b = dedup_moved(disk[i].hash, disk[i].pack, disk[i].offset);
+	return b;
+}
+
+/* a new record of (length) bytes, used by one entry */
+void dedup_add(unsigned int hash, int p, int offset, int length)
+{
+	int h;
+
+	for (h = tilehash(hash) & dedup_mask; dedup_table[h].refs; h = (h + 1) & dedup_mask);
+	dedup_table[h].hash = hash;
+	dedup_table[h].pack = p;
+	dedup_table[h].offset = offset;
+	dedup_table[h].from_pack = -1;
+	dedup_table[h].length = length;
+	dedup_table[h].refs = 1;
+	dedup_blobs++;
+	dedup_refs++;
+}
+
+/* one more entry uses the record (b) */
+void dedup_share(blob *b)
+{
+	b->refs++;
+	dedup_refs++;
+}
+
+/* an entry no longer uses the record (b), returns 1 if it was the last one
+ * the next slots are moved back, as in the disk cache index */
+int dedup_release(blob *b)
+{
+	int h = b - dedup_table, j, k;
+
+	dedup_refs--;
+	if (--b->refs)
+		return 0;
+	dedup_blobs--;
+	for (j = (h + 1) & dedup_mask; dedup_table[j].refs; j = (j + 1) & dedup_mask)
+	{
+		k = tilehash(dedup_table[j].hash) & dedup_mask;
+		if (j > h ? (k <= h || k > j) : (k <= h && k > j))
+		{
+			dedup_table[h] = dedup_table[j];
+			h = j;
+		}
+	}
+	dedup_table[h].refs = 0;
+	return 1;
+}
+
+/* empty the table for the whole disk cache, pack_count() fills it */
+void dedup_reset()
+{
+	int size = 16;
+
+	while (size < config.cache_size * 2) size *= 2;
+	if (!INDEX_HOLDS(dedup_table))
+		free(dedup_table);
+	dedup_table = calloc(size, sizeof(blob));
+	dedup_mask = size - 1;
+	dedup_blobs = dedup_refs = 0;
+}
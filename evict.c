@@ -0,0 +1,210 @@
+/* eviction of the disk cache: segmented LRU (SLRU), no ghost queue of the evicted tiles as in 2Q or ARC
+ * a new tile goes to the cold queue, it moves to the hot queue when it is seen again
+ * the tiles of a prefetch sweep never seen leave first, the tiles seen every day stay
+ * the hot queue keeps at most DISK_HOT_SHARE % of the cache, its oldest tiles go back to the cold queue
+ * each provider has its own queues, its oldest tile is found at once when it is over its budget
+ * an entry keeps its queue and the time of its last hit, the lists are saved with the index on exit
+ * and sorted again from the entries after a crash
+ * the cache is bounded in entries (config.cache_size) and in bytes (config.disk_budget MB,
+ * and the budget of each provider in limits.txt): the oldest tiles leave until it fits */
+
+#define DISK_HOT_SHARE 75
+#if defined(_PSP_FW_VERSION) || defined(GP2X)
+#define DISK_BUDGET 256
+#else
+#define DISK_BUDGET 1024
+#endif
+#define MAX_DISKBUDGET (64 * 1024)
+#define DISK_COLD 0
+#define DISK_HOT 1
+
+/* doubly linked lists of entries, -1 at the ends */
+int *disk_prev = NULL, *disk_next = NULL;
+typedef struct
+{
+	int head, tail, size;
+} diskqueue;
+
+/* the free entries, and the cold and hot tiles of each provider:
+ * the oldest tile of a provider is the tail of its queues, the oldest of the cache one of theirs */
+struct
+{
+	diskqueue free, tiles[MAX_PROVIDERS][2];
+} disk_queue;
+
+/* what the display found on disk, and what it did not */
+struct
+{
+	int hits, misses, evicted, promoted;
+} disk_stats;
+
+/* trace of the accesses to the disk cache, for pspmaps --replay */
+FILE *disk_trace = NULL;
+
+/* remove the entry (i) from its queue (q) */
+void diskqueue_unlink(int i, diskqueue *q)
+{
+	if (disk_prev[i] >= 0) disk_next[disk_prev[i]] = disk_next[i];
+	else q->head = disk_next[i];
+	if (disk_next[i] >= 0) disk_prev[disk_next[i]] = disk_prev[i];
+	else q->tail = disk_prev[i];
+	q->size--;
+}
+
+/* put the entry (i) at the head of the queue (q) */
+void diskqueue_push(int i, diskqueue *q)
+{
+	disk_prev[i] = -1;
+	disk_next[i] = q->head;
+	if (q->head >= 0) disk_prev[q->head] = i;
+	else q->tail = i;
+	q->head = i;
+	q->size++;
+}
+
+/* the queue of the entry (i), its tile must be set */
+diskqueue *diskqueue_of(int i)
+{
+	return !disk[i].fetched ? &disk_queue.free : &disk_queue.tiles[(int) net_provider[(int) disk[i].s]][(int) disk[i].hot];
+}
+
+/* the oldest tile of the queue (q) except the entry (keep), or -1 */
+int diskqueue_last(diskqueue *q, int keep)
+{
+	return q->tail < 0 || q->tail != keep ? q->tail : disk_prev[q->tail];
+}
+
+/* the cold or (hot) queue of the provider with the oldest tile except the entry (keep), or NULL */
+diskqueue *diskqueue_oldest(int hot, int keep)
+{
+	diskqueue *q, *best = NULL;
+	int p, i;
+
+	for (p = 0; p < MAX_PROVIDERS; p++)
+	{
+		q = &disk_queue.tiles[p][hot];
+		if ((i = diskqueue_last(q, keep)) >= 0 && (best == NULL || disk[i].used < disk[diskqueue_last(best, keep)].used))
+			best = q;
+	}
+	return best;
+}
+
+int diskqueue_cmp(const void *a, const void *b)
+{
+	unsigned int ua = disk[*(int *) a].used, ub = disk[*(int *) b].used;
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* build the queues of the whole disk cache, after loading or resizing it */
+void diskqueue_build()
+{
+	int *order, i;
+
+	/* the tables of the index file stay there, see index.c */
+	if (INDEX_HOLDS(disk_prev))
+		disk_prev = disk_next = NULL;
+	disk_prev = realloc(disk_prev, sizeof(int) * (config.cache_size + 1));
+	disk_next = realloc(disk_next, sizeof(int) * (config.cache_size + 1));
+	disk_queue.free.head = disk_queue.free.tail = -1;
+	disk_queue.free.size = 0;
+	for (i = 0; i < MAX_PROVIDERS * 2; i++)
+	{
+		disk_queue.tiles[i / 2][i % 2].head = disk_queue.tiles[i / 2][i % 2].tail = -1;
+		disk_queue.tiles[i / 2][i % 2].size = 0;
+	}
+
+	/* oldest hit first, each one pushed at the head */
+	order = malloc(sizeof(int) * (config.cache_size + 1));
+	for (i = 0; i < config.cache_size; i++)
+	{
+		if (disk[i].hot != DISK_HOT)
+			disk[i].hot = DISK_COLD;
+		order[i] = i;
+	}
+	qsort(order, config.cache_size, sizeof(int), diskqueue_cmp);
+	for (i = 0; i < config.cache_size; i++)
+		diskqueue_push(order[i], diskqueue_of(order[i]));
+	free(order);
+}
+
+/* returns the entry to use for a new tile: a free one, or the one to evict
+ * the evicted tile must be removed from the index and the packs */
+int diskqueue_take()
+{
+	diskqueue *q = &disk_queue.free;
+	int i;
+
+	if (!q->size && (q = diskqueue_oldest(DISK_COLD, -1)) == NULL)
+		q = diskqueue_oldest(DISK_HOT, -1);
+	i = q->tail;
+	diskqueue_unlink(i, q);
+	if (q != &disk_queue.free)
+		disk_stats.evicted++;
+	return i;
+}
+
+/* returns the oldest tile of the provider (p), or of any provider if -1, except the entry (keep)
+ * the cold queue first, as diskqueue_take(), or -1 if there is none */
+int diskqueue_victim(int p, int keep)
+{
+	diskqueue *q;
+	int hot, i;
+
+	for (hot = DISK_COLD; hot <= DISK_HOT; hot++)
+	{
+		q = p < 0 ? diskqueue_oldest(hot, keep) : &disk_queue.tiles[p][hot];
+		if (q != NULL && (i = diskqueue_last(q, keep)) >= 0)
+			return i;
+	}
+	return -1;
+}
+
+/* the entry (i) holds a new tile now */
+void diskqueue_add(int i)
+{
+	disk[i].hot = DISK_COLD;
+	disk[i].used = time(NULL);
+	diskqueue_push(i, &disk_queue.tiles[(int) net_provider[(int) disk[i].s]][DISK_COLD]);
+}
+
+/* the entry (i) no longer holds a tile */
+void diskqueue_free(int i)
+{
+	diskqueue_unlink(i, diskqueue_of(i));
+	diskqueue_push(i, &disk_queue.free);
+}
+
+/* the tile of entry (i) was needed again */
+void diskqueue_hit(int i)
+{
+	diskqueue *q;
+	int j, p, hot = 0;
+
+	disk[i].used = time(NULL);
+	diskqueue_unlink(i, diskqueue_of(i));
+	if (disk[i].hot == DISK_COLD)
+	{
+		disk[i].hot = DISK_HOT;
+		disk_stats.promoted++;
+	}
+	diskqueue_push(i, diskqueue_of(i));
+
+	/* the hot queues are full, their oldest tile gets another chance in the cold queue */
+	for (p = 0; p < MAX_PROVIDERS; p++)
+		hot += disk_queue.tiles[p][DISK_HOT].size;
+	if (hot > config.cache_size * DISK_HOT_SHARE / 100 && (q = diskqueue_oldest(DISK_HOT, -1)) != NULL)
+	{
+		j = q->tail;
+		diskqueue_unlink(j, q);
+		disk[j].hot = DISK_COLD;
+		diskqueue_push(j, diskqueue_of(j));
+	}
+}
+
+/* record an access to the disk cache:
+ * 'g' the display needed the tile, 'p' the tile was downloaded ahead */
+void disktrace(char op, int x, int y, int z, int s)
+{
+	if (disk_trace != NULL)
+		fprintf(disk_trace, "%c %d %d %d %d\n", op, x, y, z, s);
+}
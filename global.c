@@ -8,3 +8,18 @@ void latlon2xy(float lat, float lon, float *x, float *y, int z)
 	*x = pow(2, 17-z) * (lon + 180) / 360;
 	*y = pow(2, 16-z) * (1 - log((1 + e)/(1 - e)) / 2 / M_PI);
 }
+
+/* packs a tile location (x,y,z) with mode (s) in a single key */
+unsigned long long tilekey(int x, int y, int z, int s)
+{
+	return (unsigned long long) (x & 0xffffff) << 40 | (unsigned long long) (y & 0xffffff) << 16 | (z & 0xff) << 8 | (s & 0xff);
+}
+
+/* spreads the bits of a tile key, use the low bits for hash tables */
+unsigned int tilehash(unsigned long long key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key;
+}
@@ -15,3 +15,5 @@
 #endif
 
 void latlon2xy(float lat, float lon, float *x, float *y, int z);
+unsigned long long tilekey(int x, int y, int z, int s);
+unsigned int tilehash(unsigned long long key);
@@ -0,0 +1,652 @@
+/* index of the disk cache, data/disk.idx (data/disk.dat of the previous versions):
+ * a header, the entries, then the tables built from them (tile.c, evict.c, dedup.c)
+ * the file is mapped where mmap is available and the entries are used in place,
+ * nothing is read on startup but the pages touched, a checkpoint only writes the changed pages
+ * the tables and the counters are saved on exit: if pspmaps quit properly they are used as they are,
+ * otherwise they are built again from the entries
+ * without mmap, the file is read at once, and written again on checkpoints
+ *
+ * where mmap is available several processes can use the cache at once, through data/disk.lck:
+ * one of them changes the cache at a time, the counters are kept in the header meanwhile,
+ * and the tables built by a process are moved to the file for the others */
+
+#define INDEX_MAGIC 0x58444e49
+#define INDEX_VERSION 1
+#define INDEX_PAGE 4096
+
+typedef struct
+{
+	unsigned int magic, version;
+	/* size of an entry, number of entries, and slots of the tables */
+	int entry, entries, slots;
+	/* checkpoint, the journal only applies to the same one */
+	unsigned int gen;
+	/* the tables and the counters below are up to date */
+	int clean;
+	char queue[sizeof(disk_queue)];
+	int blobs, refs;
+	int live[PACK_NUM], legacy;
+	long long bytes, used[MAX_PROVIDERS];
+	/* the provider of each view when they were counted */
+	char provider[CHEAT_VIEWS][50];
+} index_header;
+
+#ifdef INDEX_SHARED
+/* data/disk.lck, its bytes are locked too: the first one while a process changes the cache,
+ * the second one by every process using it, the third one by the process that compacts the packs */
+typedef struct
+{
+	/* a process is changing the cache, if it died the tables must be built again */
+	int busy;
+	/* changes in the journal since the checkpoint */
+	int changes;
+	/* the process writing each pack, and how many times it was started */
+	int owner[PACK_NUM], born[PACK_NUM];
+} index_shared;
+
+index_shared *index_state = NULL;
+int index_fd = -1, index_depth = 0, index_compacting = 0;
+#endif
+
+/* where the parts are in the file, for a number of entries */
+typedef struct
+{
+	int slots;
+	size_t disk, table, prev, next, dedup, length;
+} index_layout;
+
+void index_plan(index_layout *l, int entries)
+{
+	l->slots = 16;
+	while (l->slots < entries * 2) l->slots *= 2;
+	l->disk = (sizeof(index_header) + INDEX_PAGE - 1) & ~(INDEX_PAGE - 1);
+	l->table = l->disk + sizeof(struct _disk) * entries;
+	l->prev = l->table + sizeof(int) * l->slots;
+	l->next = l->prev + sizeof(int) * (entries + 1);
+	l->dedup = l->next + sizeof(int) * (entries + 1);
+	l->length = l->dedup + sizeof(blob) * l->slots;
+}
+
+/* returns the file (name) of (length) bytes mapped, empty if (fresh), or NULL
+ * without mmap it is read in memory, what is missing is empty */
+char *index_map(char *name, size_t length, int fresh)
+{
+	char *base;
+	#ifdef PACK_MMAP
+	int fd;
+
+	if ((fd = open(name, O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0), 0644)) < 0)
+		return NULL;
+	if (ftruncate(fd, length) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return base == MAP_FAILED ? NULL : base;
+	#else
+	FILE *f;
+
+	base = calloc(length, 1);
+	if (!fresh && (f = fopen(name, "rb")) != NULL)
+	{
+		fread(base, 1, length, f);
+		fclose(f);
+	}
+	return base;
+	#endif
+}
+
+void index_unmap(char *base, size_t length)
+{
+	#ifdef PACK_MMAP
+	munmap(base, length);
+	#else
+	free(base);
+	#endif
+}
+
+/* the tables in the file are no longer used, before it is unmapped */
+void index_detach()
+{
+	if (INDEX_HOLDS(disk_table)) disk_table = NULL;
+	if (INDEX_HOLDS(disk_prev)) disk_prev = NULL;
+	if (INDEX_HOLDS(disk_next)) disk_next = NULL;
+	if (INDEX_HOLDS(dedup_table)) dedup_table = NULL;
+}
+
+/* write the changes of the index with the checkpoint (gen), returns 0 on error
+ * the pack lock must be held, or the compaction stopped */
+int index_sync(unsigned int gen)
+{
+	index_header *h = (index_header *) index_base;
+	#ifndef PACK_MMAP
+	index_layout l;
+	FILE *f;
+	int ok;
+	#endif
+
+	if (index_base == NULL)
+		return 0;
+	#ifdef PACK_MMAP
+	/* the entries first, then the header that makes them the checkpoint */
+	if (msync(index_base, index_length, MS_SYNC) != 0)
+		return 0;
+	h->gen = gen;
+	return msync(index_base, INDEX_PAGE, MS_SYNC) == 0;
+	#else
+	/* the tables are only useful when they are up to date */
+	index_plan(&l, h->entries);
+	h->gen = gen;
+	if ((f = fopen("data/disk.tmp", "wb")) == NULL)
+		ok = 0;
+	else
+	{
+		ok = fwrite(index_base, 1, h->clean ? l.length : l.table, f) == (h->clean ? l.length : l.table);
+		journal_fsync(f);
+		ok = fclose(f) == 0 && ok;
+	}
+	#ifdef _WIN32
+	/* no atomic replace */
+	if (ok) unlink("data/disk.idx");
+	#endif
+	if (!ok || rename("data/disk.tmp", "data/disk.idx") != 0)
+	{
+		unlink("data/disk.tmp");
+		h->gen = journal_gen;
+		return 0;
+	}
+	return 1;
+	#endif
+}
+
+/* is the provider of each view the same as when the bytes were counted */
+int index_providers(index_header *h)
+{
+	int i;
+
+	for (i = 0; i < CHEAT_VIEWS; i++)
+		if (strcmp(h->provider[i], providers[(int) net_provider[i]].domain) != 0)
+			return 0;
+	return 1;
+}
+
+/* the counters, as the last process to change the cache left them */
+void index_load()
+{
+	index_header *h = (index_header *) index_base;
+	int p;
+
+	memcpy(&disk_queue, h->queue, sizeof(disk_queue));
+	dedup_blobs = h->blobs;
+	dedup_refs = h->refs;
+	for (p = 0; p < PACK_NUM; p++)
+		pack[p].live = h->live[p];
+	pack_legacy = h->legacy;
+	pack_bytes = h->bytes;
+	memcpy(pack_used, h->used, sizeof(pack_used));
+	#ifdef INDEX_SHARED
+	if (index_state == NULL)
+		return;
+	journal_gen = h->gen;
+	journal_changes = index_state->changes;
+	/* a pack started again by another process, the previous file was deleted */
+	for (p = 0; p < PACK_NUM; p++)
+		if (pack[p].born != index_state->born[p])
+		{
+			pack_unmap(p);
+			pack[p].size = 0;
+			pack[p].retired = 0;
+			pack[p].born = index_state->born[p];
+		}
+	#endif
+}
+
+void index_store()
+{
+	index_header *h = (index_header *) index_base;
+	int p;
+
+	memcpy(h->queue, &disk_queue, sizeof(disk_queue));
+	h->blobs = dedup_blobs;
+	h->refs = dedup_refs;
+	for (p = 0; p < PACK_NUM; p++)
+		h->live[p] = pack[p].live;
+	h->legacy = pack_legacy;
+	h->bytes = pack_bytes;
+	memcpy(h->used, pack_used, sizeof(pack_used));
+	#ifdef INDEX_SHARED
+	if (index_state != NULL)
+		index_state->changes = journal_changes;
+	#endif
+}
+
+/* the tables built in memory go in the file, where the other processes and the next start find them */
+void index_attach()
+{
+	index_header *h = (index_header *) index_base;
+	index_layout l;
+
+	if (index_base == NULL || !index_length || h->entries != config.cache_size)
+		return;
+	index_plan(&l, config.cache_size);
+	if (disk_table == NULL || disk_prev == NULL || dedup_table == NULL
+		|| disk_mask != l.slots - 1 || dedup_mask != l.slots - 1)
+		return;
+	if (!INDEX_HOLDS(disk_table))
+	{
+		memcpy(index_base + l.table, disk_table, sizeof(int) * l.slots);
+		free(disk_table);
+		disk_table = (int *) (index_base + l.table);
+	}
+	if (!INDEX_HOLDS(disk_prev))
+	{
+		memcpy(index_base + l.prev, disk_prev, sizeof(int) * (config.cache_size + 1));
+		memcpy(index_base + l.next, disk_next, sizeof(int) * (config.cache_size + 1));
+		free(disk_prev);
+		free(disk_next);
+		disk_prev = (int *) (index_base + l.prev);
+		disk_next = (int *) (index_base + l.next);
+	}
+	if (!INDEX_HOLDS(dedup_table))
+	{
+		memcpy(index_base + l.dedup, dedup_table, sizeof(blob) * l.slots);
+		free(dedup_table);
+		dedup_table = (blob *) (index_base + l.dedup);
+	}
+}
+
+#ifdef INDEX_SHARED
+/* lock the byte (n) of data/disk.lck (F_WRLCK, F_RDLCK or F_UNLCK), returns 0 if another process holds it */
+int index_byte(int n, int type, int wait)
+{
+	struct flock fl;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = n;
+	fl.l_len = 1;
+	while (fcntl(index_fd, wait ? F_SETLKW : F_SETLK, &fl) != 0)
+		if (errno != EINTR)
+			return 0;
+	return 1;
+}
+
+int index_alive(int pid)
+{
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+#endif
+
+/* is the cache used by another process */
+int index_others()
+{
+	#ifdef INDEX_SHARED
+	struct flock fl;
+
+	if (index_fd < 0)
+		return 0;
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 1;
+	fl.l_len = 1;
+	return fcntl(index_fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+	#else
+	return 0;
+	#endif
+}
+
+/* build the tables again from the entries */
+void index_rebuild()
+{
+	index_detach();
+	diskindex_build();
+	diskqueue_build();
+	pack_count();
+	index_attach();
+}
+
+/* the cache is changed by this process only, until index_unlock(), with the counters of the others
+ * returns 0 if another process has it and not (wait)
+ * calls are nested, the disk cache must be held by the thread (disk_lock()) */
+int index_take(int wait)
+{
+	#ifdef INDEX_SHARED
+	if (index_state == NULL)
+		return 1;
+	if (index_depth)
+	{
+		index_depth++;
+		return 1;
+	}
+	if (!index_byte(0, F_WRLCK, wait))
+		return 0;
+	index_depth = 1;
+	index_load();
+	if (index_state->busy)
+	{
+		/* a process died while it changed them */
+		printf("index: the cache was left unfinished, building its tables again\n");
+		index_rebuild();
+		/* its journal can end with a torn change, the next ones would be lost on recovery */
+		journal_checkpoint();
+	}
+	index_state->busy = 1;
+	#endif
+	return 1;
+}
+
+void index_lock()
+{
+	index_take(1);
+}
+
+void index_unlock()
+{
+	#ifdef INDEX_SHARED
+	if (index_state == NULL || --index_depth)
+		return;
+	index_attach();
+	index_store();
+	index_state->busy = 0;
+	index_byte(0, F_UNLCK, 0);
+	#endif
+}
+
+/* hold the disk cache for this thread, returns 0 if another thread has it and not (wait) */
+int disk_hold(int wait)
+{
+	SDL_LockMutex(pack_lock);
+	while (pack_held && pack_holder != SDL_ThreadID())
+	{
+		if (!wait)
+		{
+			SDL_UnlockMutex(pack_lock);
+			return 0;
+		}
+		SDL_CondWait(pack_free, pack_lock);
+	}
+	pack_holder = SDL_ThreadID();
+	pack_held++;
+	SDL_UnlockMutex(pack_lock);
+	return 1;
+}
+
+void disk_release()
+{
+	SDL_LockMutex(pack_lock);
+	if (!--pack_held)
+		SDL_CondBroadcast(pack_free);
+	SDL_UnlockMutex(pack_lock);
+}
+
+void disk_lock()
+{
+	disk_hold(1);
+	index_lock();
+}
+
+/* same as disk_lock(), returns 0 at once if the cache is busy (writing, syncing...)
+ * for the display, that does not wait for the storage */
+int disk_trylock()
+{
+	if (!disk_hold(0))
+		return 0;
+	if (!index_take(0))
+	{
+		disk_release();
+		return 0;
+	}
+	return 1;
+}
+
+void disk_unlock()
+{
+	index_unlock();
+	disk_release();
+}
+
+/* wait for (ms) or a signal of pack_cond, the other threads and processes can have the cache meanwhile
+ * the cache must be held once */
+void disk_wait(int ms)
+{
+	index_unlock();
+	SDL_LockMutex(pack_lock);
+	pack_held = 0;
+	SDL_CondBroadcast(pack_free);
+	SDL_CondWaitTimeout(pack_cond, pack_lock, ms);
+	while (pack_held)
+		SDL_CondWait(pack_free, pack_lock);
+	pack_holder = SDL_ThreadID();
+	pack_held = 1;
+	SDL_UnlockMutex(pack_lock);
+	index_lock();
+}
+
+/* is the pack (p) written or compacted by another process */
+int index_owned(int p)
+{
+	#ifdef INDEX_SHARED
+	return index_state != NULL && index_state->owner[p] != getpid() && index_alive(index_state->owner[p]);
+	#else
+	return 0;
+	#endif
+}
+
+/* the pack (p) is written or compacted by this process, returns 0 if another one does
+ * when it is empty a new file is started, the others forget the previous one
+ * the index lock must be held */
+int index_claim(int p)
+{
+	#ifdef INDEX_SHARED
+	if (index_state == NULL)
+		return 1;
+	if (index_owned(p))
+		return 0;
+	if (!pack[p].size)
+	{
+		pack_unmap(p);
+		pack[p].born = ++index_state->born[p];
+	}
+	index_state->owner[p] = getpid();
+	#endif
+	return 1;
+}
+
+void index_release(int p)
+{
+	#ifdef INDEX_SHARED
+	if (index_state != NULL && index_state->owner[p] == getpid())
+		index_state->owner[p] = 0;
+	#endif
+}
+
+/* does this process compact the packs, only one of them does */
+int index_compactor()
+{
+	#ifdef INDEX_SHARED
+	if (index_state != NULL && !index_compacting)
+		index_compacting = index_byte(2, F_WRLCK, 0);
+	return index_state == NULL || index_compacting;
+	#else
+	return 1;
+	#endif
+}
+
+/* join the processes using the cache, with the index locked until index_unlock()
+ * index_alone is 0 if there are others, the cache is theirs as it is then */
+void index_join()
+{
+	#ifdef INDEX_SHARED
+	char *state;
+
+	if ((index_fd = open("data/disk.lck", O_RDWR | O_CREAT, 0644)) < 0)
+		return;
+	index_byte(0, F_WRLCK, 1);
+	index_alone = !index_others();
+	index_byte(1, F_RDLCK, 1);
+	/* what the last ones left is stale */
+	if ((index_alone && ftruncate(index_fd, 0) != 0) || ftruncate(index_fd, sizeof(index_shared)) != 0
+		|| (state = mmap(NULL, sizeof(index_shared), PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0)) == MAP_FAILED)
+	{
+		printf("index: cannot map data/disk.lck, the cache is not shared\n");
+		close(index_fd);
+		index_fd = -1;
+		index_alone = 1;
+		return;
+	}
+	index_state = (index_shared *) state;
+	index_depth = 1;
+	index_state->busy = 0;
+	#endif
+}
+
+/* map the index, returns 1 if its tables are ready, or 0 if they must be built
+ * (*found) is 0 if there was no index, it is empty then
+ * the size of the index wins over the one of config.dat, the index is locked until index_unlock() */
+int index_open(int *found)
+{
+	index_header head, *h;
+	index_layout l;
+	FILE *f;
+
+	index_join();
+	*found = 0;
+	if ((f = fopen("data/disk.idx", "rb")) != NULL)
+	{
+		/* a new index is only used once it is saved */
+		*found = fread(&head, sizeof(head), 1, f) == 1 && head.magic == INDEX_MAGIC && head.version == INDEX_VERSION
+			&& head.entry == sizeof(struct _disk) && head.entries > 0 && head.gen;
+		fclose(f);
+	}
+	if (*found)
+		config.cache_size = head.entries;
+	index_plan(&l, config.cache_size);
+	if ((!*found && !index_alone) || (index_base = index_map("data/disk.idx", l.length, !*found)) == NULL)
+	{
+		/* no room for it? the cache is disabled */
+		printf("index: cannot map data/disk.idx\n");
+		*found = 0;
+		config.cache_size = 0;
+		index_plan(&l, 0);
+		index_base = calloc(l.length, 1);
+		/* not to be unmapped */
+		index_length = 0;
+	}
+	else
+		index_length = l.length;
+	h = (index_header *) index_base;
+	disk = (struct _disk *) (index_base + l.disk);
+	if (!*found)
+	{
+		h->magic = INDEX_MAGIC;
+		h->version = INDEX_VERSION;
+		h->entry = sizeof(struct _disk);
+		h->entries = config.cache_size;
+		h->slots = l.slots;
+		return 0;
+	}
+	journal_gen = h->gen;
+	/* the tables of the other processes are up to date */
+	if (index_alone && (!h->clean || h->slots != l.slots || !index_providers(h)))
+		return 0;
+
+	/* as they were on exit */
+	disk_table = (int *) (index_base + l.table);
+	disk_mask = l.slots - 1;
+	disk_prev = (int *) (index_base + l.prev);
+	disk_next = (int *) (index_base + l.next);
+	dedup_table = (blob *) (index_base + l.dedup);
+	dedup_mask = l.slots - 1;
+	index_load();
+
+	/* they change from now on, a crash must not find them clean */
+	h->clean = 0;
+	#ifdef PACK_MMAP
+	msync(index_base, INDEX_PAGE, MS_SYNC);
+	#endif
+	return 1;
+}
+
+/* the cache has config.cache_size entries instead of (old), the first ones are kept
+ * the tables must be built again, the pack lock must be held and no other process use the cache */
+void index_resize(int old)
+{
+	index_header *h;
+	index_layout l;
+	char *base = index_base;
+	size_t length = index_length;
+	int i;
+
+	/* the tables of the previous file go with it */
+	index_detach();
+	index_plan(&l, config.cache_size);
+	#ifdef PACK_MMAP
+	h = (index_header *) index_map("data/disk.tmp", l.length, 1);
+	#else
+	h = (index_header *) index_map(NULL, l.length, 1);
+	#endif
+	if (h == NULL)
+	{
+		/* keep the current one, without the tiles already dropped */
+		printf("index: cannot resize data/disk.idx\n");
+		for (i = config.cache_size; i < old; i++)
+			disk[i].fetched = 0;
+		config.cache_size = old;
+		return;
+	}
+	memcpy(h, base, sizeof(index_header));
+	memcpy((char *) h + l.disk, disk, sizeof(struct _disk) * (old < config.cache_size ? old : config.cache_size));
+	h->entries = config.cache_size;
+	h->slots = l.slots;
+	h->clean = 0;
+	index_base = (char *) h;
+	index_length = l.length;
+	disk = (struct _disk *) (index_base + l.disk);
+	#ifdef PACK_MMAP
+	if (index_sync(journal_gen))
+		rename("data/disk.tmp", "data/disk.idx");
+	#else
+	index_sync(journal_gen);
+	#endif
+	if (length)
+		index_unmap(base, length);
+}
+
+/* save the tables with the index and unmap it, on exit
+ * the downloads and the compaction must be stopped */
+void index_close()
+{
+	index_header *h = (index_header *) index_base;
+	int i;
+
+	if (index_base == NULL)
+		return;
+	index_lock();
+	index_attach();
+	index_store();
+	/* the last process leaves it clean */
+	if (INDEX_HOLDS(disk_table) && INDEX_HOLDS(disk_prev) && INDEX_HOLDS(dedup_table) && !index_others())
+	{
+		for (i = 0; i < CHEAT_VIEWS; i++)
+			strcpy(h->provider[i], providers[(int) net_provider[i]].domain);
+		h->clean = 1;
+	}
+	/* with the header, the journal is empty */
+	if (!journal_checkpoint())
+		h->clean = 0;
+	index_unlock();
+	index_detach();
+	if (index_length)
+		index_unmap(index_base, index_length);
+	index_base = NULL;
+	#ifdef INDEX_SHARED
+	if (index_state != NULL)
+		munmap(index_state, sizeof(index_shared));
+	index_state = NULL;
+	/* and the locks */
+	if (index_fd >= 0)
+		close(index_fd);
+	#endif
+}
@@ -0,0 +1,167 @@
+/* journal of the disk cache index: every change of an entry is appended to data/disk.jnl,
+ * so that a crash does not lose the tiles saved since the index was written
+ * the index (see index.c) is a checkpoint, written again when the journal grows and on exit
+ * the changes are only flushed: the packs and the journal are synced every few seconds
+ * and on checkpoints, a torn change at the end is ignored on recovery
+ * the records of the packs hold their tile, a tile can be lost but never mixed up
+ * the processes sharing the cache append their changes to the same journal, under the index lock */
+
+#define JOURNAL_MAGIC 0x4c4e4a44
+#define JOURNAL_MIN 1024
+#define JOURNAL_SYNC 5
+
+/* the new content of the entry (i) */
+typedef struct
+{
+	unsigned int magic;
+	int i;
+	struct _disk entry;
+	unsigned int sum;
+} change;
+
+FILE *journal = NULL;
+int journal_changes = 0;
+time_t journal_synced = 0;
+
+/* checkpoint of the index, the journal only applies to the same one */
+unsigned int journal_gen = 0;
+
+/* FNV-1a of the change, to find a torn one */
+unsigned int journal_sum(change *c)
+{
+	unsigned char *p = (unsigned char *) c;
+	unsigned int h = 2166136261U;
+	int n;
+
+	for (n = 0; n < sizeof(change) - sizeof(c->sum); n++)
+		h = (h ^ p[n]) * 16777619U;
+	return h;
+}
+
+/* make sure (f) is on the storage */
+void journal_fsync(FILE *f)
+{
+	fflush(f);
+	#if !defined(_PSP_FW_VERSION) && !defined(_WIN32)
+	fsync(fileno(f));
+	#endif
+}
+
+/* start an empty journal for the current index
+ * the other processes keep it open, it is emptied in place */
+void journal_open()
+{
+	unsigned int header[2] = {JOURNAL_MAGIC, journal_gen};
+
+	#ifdef INDEX_SHARED
+	if (journal == NULL)
+		journal = fopen("data/disk.jnl", "ab");
+	if (journal != NULL && ftruncate(fileno(journal), 0) != 0)
+	{
+		fclose(journal);
+		journal = NULL;
+	}
+	#else
+	if (journal != NULL)
+		fclose(journal);
+	journal = fopen("data/disk.jnl", "wb");
+	#endif
+	if (journal != NULL)
+	{
+		fwrite(header, sizeof(header), 1, journal);
+		fflush(journal);
+	}
+	journal_changes = 0;
+	journal_synced = time(NULL);
+}
+
+/* write the index and start a new journal, returns 0 on error
+ * the compacted packs are no longer used then, they are deleted
+ * the pack lock must be held, or the compaction stopped */
+int journal_checkpoint()
+{
+	pack_sync();
+	/* a crash while the index is written replays the changes */
+	if (journal != NULL)
+		journal_fsync(journal);
+	if (!index_sync(journal_gen + 1))
+	{
+		DEBUG("journal: cannot write the index\n");
+		return 0;
+	}
+	journal_gen++;
+
+	/* a crash before this point finds a journal of the previous checkpoint, and ignores it */
+	journal_open();
+	pack_clean();
+	return 1;
+}
+
+/* append the new content of the entry (i), the pack lock must be held */
+void journal_write(int i)
+{
+	change c;
+
+	if (journal == NULL) return;
+
+	c.magic = JOURNAL_MAGIC;
+	c.i = i;
+	c.entry = disk[i];
+	c.sum = journal_sum(&c);
+	fwrite(&c, sizeof(c), 1, journal);
+	fflush(journal);
+
+	/* the checkpoints are proportional to the cache, their cost per tile stays the same */
+	if (++journal_changes > config.cache_size / 4 + JOURNAL_MIN)
+		journal_checkpoint();
+	else if (time(NULL) - journal_synced >= JOURNAL_SYNC)
+	{
+		/* the tiles first, then the changes that point to them */
+		pack_sync();
+		journal_fsync(journal);
+		journal_synced = time(NULL);
+	}
+}
+
+/* apply the changes of the journal since the index was written, on startup */
+void journal_replay()
+{
+	FILE *f;
+	change c;
+	unsigned int header[2];
+
+	/* the other processes applied them */
+	if (!index_alone)
+		return;
+	journal_changes = 0;
+	if ((f = fopen("data/disk.jnl", "rb")) == NULL)
+		return;
+	if (fread(header, sizeof(header), 1, f) == 1 && header[0] == JOURNAL_MAGIC && header[1] == journal_gen)
+		while (fread(&c, sizeof(c), 1, f) == 1 && c.magic == JOURNAL_MAGIC && c.sum == journal_sum(&c))
+		{
+			if (c.i >= 0 && c.i < config.cache_size)
+				disk[c.i] = c.entry;
+			journal_changes++;
+		}
+	fclose(f);
+	if (journal_changes)
+		printf("journal: %d changes recovered\n", journal_changes);
+}
+
+/* start the journal, once the packs are found
+ * the recovered changes are written to the index first */
+void journal_start()
+{
+	if (!index_alone)
+	{
+		journal = fopen("data/disk.jnl", "ab");
+		return;
+	}
+	if (journal_changes && journal_checkpoint())
+		return;
+	/* could not write the index: keep the recovered changes */
+	if (journal_changes)
+		journal = fopen("data/disk.jnl", "ab");
+	else
+		journal_open();
+}
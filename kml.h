@@ -33,6 +33,9 @@ typedef struct _Placemark
 	struct _Placemark *next;
 } Placemark;
 
+extern Placemark *places;
+
+void kml_parse(char *file);
 void kml_load();
 void kml_free();
 void kml_display(SDL_Surface *dst, float x, float y, int z);
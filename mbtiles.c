@@ -0,0 +1,300 @@
+/* import and export of the disk cache as MBTiles (pspmaps --import, --export)
+ * an MBTiles file is a SQLite database of the tiles of one view,
+ * their rows are counted from the south (TMS) and the zoom levels are the standard ones
+ * the tiles are streamed between the packs and the database, in transactions of MBTILES_BATCH tiles
+ * with the disk cache held for each batch only: the display, the downloads and the other processes go on
+ * the images are exported as they are, PNG or JPEG, the decoded tiles as PNG again */
+
+#define MBTILES_BATCH 1000
+/* deflate blocks stored without compression, at most this size */
+#define MBTILES_STORED 65535
+
+#ifdef HAVE_SQLITE
+
+/* run (sql), returns 0 on error */
+int mbtiles_exec(sqlite3 *db, char *sql)
+{
+	char *error;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK)
+	{
+		printf("mbtiles: %s\n", error);
+		sqlite3_free(error);
+		return 0;
+	}
+	return 1;
+}
+
+/* set the metadata (name) to (value) */
+void mbtiles_meta(sqlite3 *db, char *name, char *value)
+{
+	char *sql = sqlite3_mprintf("INSERT INTO metadata VALUES (%Q, %Q)", name, value);
+	mbtiles_exec(db, sql);
+	sqlite3_free(sql);
+}
+
+/* write (v) at (p) in network order, returns the end */
+unsigned char *mbtiles_u32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+/* the PNG chunk (type) with (n) bytes of data at (p) + 8 gets its length and CRC, returns its end */
+unsigned char *mbtiles_chunk(unsigned char *p, char *type, int n)
+{
+	unsigned int crc = 0xffffffff;
+	int i, k;
+
+	mbtiles_u32(p, n);
+	memcpy(p + 4, type, 4);
+	for (i = 4; i < n + 8; i++)
+	{
+		crc ^= p[i];
+		for (k = 0; k < 8; k++)
+			crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+	}
+	return mbtiles_u32(p + n + 8, ~crc);
+}
+
+/* returns the decoded (tile) as a PNG of (*n) bytes, to free, or NULL
+ * without compression: the deflate data is made of stored blocks */
+char *mbtiles_png(SDL_Surface *tile, int *n)
+{
+	unsigned char *png, *p, *idat, *row;
+	unsigned int a = 1, b = 0, pixel;
+	int raw = tile->h * (1 + tile->w * 3), block, x, y, i;
+	Uint8 red, green, blue;
+
+	*n = 8 + 25 + 12 + 2 + raw + 5 * (raw / MBTILES_STORED + 1) + 4 + 12;
+	if ((png = malloc(*n)) == NULL)
+		return NULL;
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = png + 8;
+	mbtiles_u32(p + 8, tile->w);
+	mbtiles_u32(p + 12, tile->h);
+	/* 8 bits RGB, deflate, no filter, no interlace */
+	memcpy(p + 16, "\x08\x02\x00\x00\x00", 5);
+	p = mbtiles_chunk(p, "IHDR", 13);
+
+	/* a row is its filter type then its pixels, the blocks are cut anywhere */
+	idat = p;
+	p += 8;
+	*p++ = 0x78;
+	*p++ = 0x01;
+	SDL_LockSurface(tile);
+	for (i = 0, block = 0; i < raw; i++, block--)
+	{
+		if (!block)
+		{
+			block = raw - i < MBTILES_STORED ? raw - i : MBTILES_STORED;
+			*p++ = block == raw - i;
+			*p++ = block;
+			*p++ = block >> 8;
+			*p++ = ~block;
+			*p++ = ~block >> 8;
+		}
+		y = i / (1 + tile->w * 3);
+		x = i % (1 + tile->w * 3);
+		if (!x)
+			*p = 0;
+		else
+		{
+			row = (unsigned char *) tile->pixels + y * tile->pitch;
+			memcpy(&pixel, row + (x - 1) / 3 * 4, 4);
+			SDL_GetRGB(pixel, tile->format, &red, &green, &blue);
+			*p = (x - 1) % 3 == 0 ? red : (x - 1) % 3 == 1 ? green : blue;
+		}
+		a = (a + *p) % 65521;
+		b = (b + a) % 65521;
+		p++;
+	}
+	SDL_UnlockSurface(tile);
+	p = mbtiles_u32(p, b << 16 | a);
+	p = mbtiles_chunk(idat, "IDAT", p - idat - 8);
+	p = mbtiles_chunk(p, "IEND", 0);
+	*n = p - png;
+	return (char *) png;
+}
+
+/* export the cached tiles of view (s) to (file) */
+void mbtiles_export(char *file, int s)
+{
+	SDL_Surface *tile;
+	sqlite3 *db;
+	sqlite3_stmt *insert;
+	char *data, *png, buf[20];
+	int *order, i, k, end, n = 0, size, format, copy, zoom, done = 0, converted = 0, jpeg = 0, t, zmin = 99, zmax = -1;
+	float bytes = 0;
+
+	if (sqlite3_open(file, &db) != SQLITE_OK)
+	{
+		printf("mbtiles: cannot open %s\n", file);
+		sqlite3_close(db);
+		return;
+	}
+	if (!mbtiles_exec(db, "PRAGMA synchronous = OFF; PRAGMA journal_mode = MEMORY;"
+		"CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+		"CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);"
+		"CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);"
+		"BEGIN")
+		|| sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO tiles VALUES (?, ?, ?, ?)", -1, &insert, NULL) != SQLITE_OK)
+	{
+		sqlite3_close(db);
+		return;
+	}
+
+	/* the packs are read in order, without the compaction of this process moving them */
+	pack_quit();
+	disk_lock();
+	order = malloc(sizeof(int) * (config.cache_size + 1));
+	for (i = 0; i < config.cache_size; i++)
+		if (disk[i].fetched && disk[i].s == s)
+			order[n++] = i;
+	qsort(order, n, sizeof(int), verify_order);
+	disk_unlock();
+
+	t = SDL_GetTicks();
+	for (k = 0; k < n; )
+	{
+		disk_lock();
+		for (end = k + MBTILES_BATCH < n ? k + MBTILES_BATCH : n; k < end; k++)
+		{
+			i = order[k];
+			/* the other processes may have changed it since */
+			if (!disk[i].fetched || disk[i].s != s || (data = pack_data(i, &size, &format, &copy)) == NULL)
+				continue;
+			png = NULL;
+			if (format != PACK_IMAGE)
+			{
+				/* the decoded tiles have no image to export, they are encoded again */
+				if ((tile = loadtile(data, size, format)) != NULL)
+				{
+					png = mbtiles_png(tile, &size);
+					SDL_FreeSurface(tile);
+				}
+				if (copy) free(data);
+				if (png == NULL)
+					continue;
+				data = png;
+				copy = 1;
+				converted++;
+			}
+			else if ((unsigned char) data[0] == 0xff)
+				jpeg++;
+			zoom = 17 - disk[i].z;
+			sqlite3_bind_int(insert, 1, zoom);
+			sqlite3_bind_int(insert, 2, disk[i].x);
+			sqlite3_bind_int(insert, 3, (1 << zoom) - 1 - disk[i].y);
+			sqlite3_bind_blob(insert, 4, data, size, SQLITE_STATIC);
+			if (sqlite3_step(insert) != SQLITE_DONE)
+				printf("mbtiles: %s\n", sqlite3_errmsg(db));
+			sqlite3_reset(insert);
+			if (zoom < zmin) zmin = zoom;
+			if (zoom > zmax) zmax = zoom;
+			bytes += size;
+			done++;
+			if (copy) free(data);
+		}
+		disk_unlock();
+		mbtiles_exec(db, "COMMIT; BEGIN");
+	}
+	free(order);
+	sqlite3_finalize(insert);
+
+	mbtiles_exec(db, "DELETE FROM metadata");
+	mbtiles_meta(db, "name", _view[s]);
+	mbtiles_meta(db, "type", "baselayer");
+	mbtiles_meta(db, "version", "1");
+	mbtiles_meta(db, "description", "PSP-Maps disk cache");
+	/* one format for the whole file, the readers look at the tiles themselves */
+	mbtiles_meta(db, "format", jpeg * 2 > done ? "jpg" : "png");
+	if (done)
+	{
+		sprintf(buf, "%d", zmin);
+		mbtiles_meta(db, "minzoom", buf);
+		sprintf(buf, "%d", zmax);
+		mbtiles_meta(db, "maxzoom", buf);
+	}
+	mbtiles_exec(db, "COMMIT");
+	sqlite3_close(db);
+
+	t = SDL_GetTicks() - t;
+	printf("mbtiles: %d tiles of %s exported to %s, %d decoded ones encoded again\n", done, _view[s], file, converted);
+	printf("mbtiles: %.1f MB in %.2f s, %.0f tiles/s\n", bytes / 1048576, t / 1000.0, done * 1000.0 / (t ? t : 1));
+}
+
+/* import the tiles of (file) into the disk cache, as view (s) */
+void mbtiles_import(char *file, int s)
+{
+	sqlite3 *db;
+	sqlite3_stmt *select;
+	int zoom, x, y, n, done = 0, skipped = 0, t;
+	float bytes = 0;
+
+	if (!config.cache_size)
+	{
+		printf("mbtiles: the disk cache is disabled\n");
+		return;
+	}
+	if (sqlite3_open_v2(file, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK
+		|| sqlite3_prepare_v2(db, "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles", -1, &select, NULL) != SQLITE_OK)
+	{
+		printf("mbtiles: cannot read %s: %s\n", file, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return;
+	}
+
+	/* the rows are read one by one, and appended to the packs with the disk cache held a batch at a time */
+	t = SDL_GetTicks();
+	disk_lock();
+	while (sqlite3_step(select) == SQLITE_ROW)
+	{
+		zoom = sqlite3_column_int(select, 0);
+		x = sqlite3_column_int(select, 1);
+		y = sqlite3_column_int(select, 2);
+		n = sqlite3_column_bytes(select, 3);
+		if (zoom < 0 || zoom > 21 || x < 0 || x >= 1 << zoom || y < 0 || y >= 1 << zoom || !n)
+		{
+			skipped++;
+			continue;
+		}
+		y = (1 << zoom) - 1 - y;
+		writedisk(x, y, 17 - zoom, s, (char *) sqlite3_column_blob(select, 3), n, PACK_IMAGE, "", 0);
+		disktrace('p', x, y, 17 - zoom, s);
+		bytes += n;
+		if (++done % MBTILES_BATCH == 0)
+		{
+			disk_unlock();
+			printf("\rmbtiles: %d tiles", done);
+			fflush(stdout);
+			disk_lock();
+		}
+	}
+	disk_unlock();
+	sqlite3_finalize(select);
+	sqlite3_close(db);
+
+	t = SDL_GetTicks() - t;
+	printf("\rmbtiles: %d tiles imported from %s as %s, %d skipped\n", done, file, _view[s], skipped);
+	printf("mbtiles: %.1f MB in %.2f s, %.0f tiles/s\n", bytes / 1048576, t / 1000.0, done * 1000.0 / (t ? t : 1));
+	if (done > config.cache_size)
+		printf("mbtiles: the disk cache only keeps %d tiles, make it bigger in the menu\n", config.cache_size);
+}
+
+#else
+
+void mbtiles_export(char *file, int s)
+{
+	printf("mbtiles: built without SQLite (make HAVE_SQLITE=1)\n");
+}
+
+void mbtiles_import(char *file, int s)
+{
+	printf("mbtiles: built without SQLite (make HAVE_SQLITE=1)\n");
+}
+
+#endif
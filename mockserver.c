@@ -0,0 +1,256 @@
+/* local stand-in for the tile servers, to test and benchmark the downloads
+ * without hitting the real providers (see urls-mock.txt)
+ *
+ * the tile is found from the query string, whatever the path:
+ *   x, y, z      XYZ tile, standard zoom (0 = whole world)
+ *   ty           TMS tile: y counted from the bottom
+ *   zoom         PSP-Maps zoom (17 - z), as used by Google Maps
+ *   yy, yz       Yahoo! Maps tile: flipped y, zoom 18 - z
+ *   q            Virtual Earth quadkey
+ *   t            Google "t" tile string (qrst)
+ *
+ * usage: mockserver [-p port] [-l latency ms] [-j jitter ms] [-e error %]
+ *                   [-b KB/s] [-f tile.png] [-r recorded dir]
+ * recorded tiles are read from dir/z/x/y.png, the others get the same tile */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MOCK_PORT 8080
+#define MOCK_CHUNK 1024
+
+int port = MOCK_PORT, latency = 0, jitter = 0, errors = 0, bandwidth = 0;
+char *tile, *recorded = NULL;
+int tile_size;
+
+/* statistics, printed on exit */
+int served = 0, failed = 0, missing = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* returns the content of file (name) and its size in (size), or NULL */
+char *load(char *name, int *size)
+{
+	FILE *f;
+	char *data;
+
+	if ((f = fopen(name, "rb")) == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(*size);
+	if (fread(data, 1, *size, f) != *size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+/* returns in (v) the value of the parameter (name) of the query (q) */
+int param(char *q, char *name, char *v, int size)
+{
+	int n = strlen(name), i;
+
+	while (q != NULL && *q)
+	{
+		if (strncmp(q, name, n) == 0 && q[n] == '=')
+		{
+			q += n + 1;
+			for (i = 0; i < size - 1 && q[i] && q[i] != '&' && q[i] != ' '; i++)
+				v[i] = q[i];
+			v[i] = '\0';
+			return 1;
+		}
+		if ((q = strchr(q, '&')) != NULL) q++;
+	}
+	return 0;
+}
+
+/* decode the tile (x,y,z) requested by the query (q), returns 0 if it is not valid */
+int decode(char *q, int *x, int *y, int *z)
+{
+	char v[50], *c;
+
+	*x = *y = *z = -1;
+	if (param(q, "q", v, sizeof(v)) || param(q, "t", v, sizeof(v)))
+	{
+		/* one digit per zoom level, the Google string starts with a 't' for the world */
+		c = v;
+		if (*c == 't') c++;
+		*x = *y = *z = 0;
+		for (; *c; c++, (*z)++)
+		{
+			*x *= 2;
+			*y *= 2;
+			switch (*c)
+			{
+				case '0': case 'q': break;
+				case '1': case 'r': *x += 1; break;
+				case '2': case 't': *y += 1; break;
+				case '3': case 's': *x += 1; *y += 1; break;
+				default: return 0;
+			}
+		}
+		return 1;
+	}
+	if (param(q, "z", v, sizeof(v))) *z = atoi(v);
+	if (param(q, "zoom", v, sizeof(v))) *z = 17 - atoi(v);
+	if (param(q, "yz", v, sizeof(v))) *z = 18 - atoi(v);
+	if (param(q, "x", v, sizeof(v))) *x = atoi(v);
+	if (param(q, "y", v, sizeof(v))) *y = atoi(v);
+	if (*z < 0 || *z > 30) return 0;
+	if (param(q, "ty", v, sizeof(v))) *y = (1 << *z) - atoi(v) - 1;
+	if (param(q, "yy", v, sizeof(v))) *y = (1 << (*z - 1)) - atoi(v) - 1;
+	return *x >= 0 && *y >= 0 && *x < (1 << *z) && *y < (1 << *z);
+}
+
+/* send (n) bytes, at the configured bandwidth */
+int send_all(int fd, char *data, int n)
+{
+	int sent, chunk;
+
+	while (n > 0)
+	{
+		chunk = bandwidth && n > MOCK_CHUNK ? MOCK_CHUNK : n;
+		if ((sent = send(fd, data, chunk, MSG_NOSIGNAL)) <= 0)
+			return 0;
+		data += sent;
+		n -= sent;
+		if (bandwidth)
+			usleep(1000000LL * sent / (bandwidth * 1024));
+	}
+	return 1;
+}
+
+/* answer the requests of a connection, kept alive */
+void *client(void *arg)
+{
+	int fd = (long) arg, n = 0, r, x, y, z, size, code;
+	char request[4096], header[256], name[1024], *end, *q, *data;
+
+	while ((r = recv(fd, request + n, sizeof(request) - n - 1, 0)) > 0)
+	{
+		n += r;
+		request[n] = '\0';
+		while ((end = strstr(request, "\r\n\r\n")) != NULL)
+		{
+			*end = '\0';
+			if ((q = strchr(request, '?')) != NULL) q++;
+
+			if (latency || jitter)
+				usleep(1000 * (latency + (jitter ? rand() % (2 * jitter + 1) - jitter : 0)));
+
+			data = NULL;
+			if (!decode(q, &x, &y, &z))
+				code = 400;
+			else if (errors && rand() % 100 < errors)
+				code = 503;
+			else if (recorded == NULL)
+			{
+				code = 200;
+				data = tile;
+				size = tile_size;
+			}
+			else
+			{
+				sprintf(name, "%.900s/%d/%d/%d.png", recorded, z, x, y);
+				code = (data = load(name, &size)) != NULL ? 200 : 404;
+			}
+
+			pthread_mutex_lock(&lock);
+			if (code == 200) served++;
+			else if (code == 404) missing++;
+			else failed++;
+			pthread_mutex_unlock(&lock);
+
+			if (code == 200)
+				sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: %d\r\nETag: \"%d-%d-%d\"\r\n\r\n", size, x, y, z);
+			else
+				sprintf(header, "HTTP/1.1 %d Error\r\nContent-Length: 0\r\n\r\n", code);
+			r = send_all(fd, header, strlen(header)) && (data == NULL || send_all(fd, data, size));
+			if (data != tile) free(data);
+			if (!r) goto done;
+
+			/* keep the next pipelined request */
+			end += 4;
+			n -= end - request;
+			memmove(request, end, n + 1);
+		}
+		if (n == sizeof(request) - 1) break;
+	}
+
+done:
+	close(fd);
+	return NULL;
+}
+
+void stop(int sig)
+{
+	printf("mockserver: %d served, %d errors, %d missing\n", served, failed, missing);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int fd, c, one = 1;
+	char *file = "data/na.png";
+
+	while ((c = getopt(argc, argv, "p:l:j:e:b:f:r:")) != -1)
+		switch (c)
+		{
+			case 'p': port = atoi(optarg); break;
+			case 'l': latency = atoi(optarg); break;
+			case 'j': jitter = atoi(optarg); break;
+			case 'e': errors = atoi(optarg); break;
+			case 'b': bandwidth = atoi(optarg); break;
+			case 'f': file = optarg; break;
+			case 'r': recorded = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] [-l latency ms] [-j jitter ms] [-e error %%] [-b KB/s] [-f tile.png] [-r recorded dir]\n", argv[0]);
+				return 1;
+		}
+	if (jitter > latency) jitter = latency;
+
+	if ((tile = load(file, &tile_size)) == NULL)
+	{
+		fprintf(stderr, "cannot read %s\n", file);
+		return 1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+	{
+		perror("mockserver");
+		return 1;
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	printf("mockserver: listening on 127.0.0.1:%d\n", port);
+	fflush(stdout);
+
+	while ((c = accept(fd, NULL, NULL)) >= 0)
+	{
+		setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_create(&thread, NULL, client, (void *) (long) c);
+		pthread_detach(thread);
+	}
+	return 0;
+}
@@ -0,0 +1,809 @@
+/* background downloads: a worker thread drives a curl multi handle
+ * so that the display never waits on the network */
+
+#define NET_TRANSFERS 4
+#define MAX_TRANSFERS 16
+#define NET_TIMEOUT 10
+#define NET_CONNECT_TIMEOUT 5
+#define NET_HASH 256
+#define NET_MAX_SIZE 1024 * 1024
+#define NET_RPS 10
+#define NET_CONNECTIONS 4
+#define MAX_PROVIDERS 16
+#define NET_ERRORS 3
+#define NET_BACKOFF 2000
+#define MAX_BACKOFF 300000
+#define NET_FAILED 256
+
+/* states of a download job */
+enum
+{
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE
+};
+
+/* download priorities, most urgent first */
+enum
+{
+	PRIO_VISIBLE,
+	PRIO_RING,
+	PRIO_PREDICT,
+	PRIO_ZOOM,
+	PRIO_BULK,
+	PRIO_NUM
+};
+
+/* growable buffer for a download, always null terminated
+ * the transfer fails if it would grow over max bytes */
+typedef struct
+{
+	char *ptr;
+	int size, alloc, max;
+} netbuf;
+
+typedef struct _job
+{
+	int x, y;
+	char z, s;
+	char state, prio;
+	/* show: wanted on screen, bulk: wanted by a cache sweep, never cancelled
+	 * refresh: conditional request for a tile already on disk */
+	char show, bulk, cancel, refresh;
+	int ok, gen, code;
+	/* HTTP validators: match is sent for a refresh, kept if the job starts again,
+	 * etag is received with the tile */
+	char match[100], etag[100];
+	unsigned int modified;
+	struct curl_slist *headers;
+	netbuf buf;
+	CURL *curl;
+	struct _job *next, *hnext;
+} job;
+
+/* all jobs, in request order, shared with the worker thread */
+job *jobs = NULL, **jobs_last = &jobs;
+int net_jobs = 0, net_running = 0, net_stop = 0;
+
+/* bumped when the view changes, jobs not requested since then are stale */
+int net_gen = 0;
+
+/* jobs by tile, so that a tile is only downloaded once at a time */
+job *net_table[NET_HASH];
+SDL_mutex *net_lock;
+SDL_cond *net_cond;
+SDL_Thread *net_thread = NULL;
+
+/* idle curl handles, kept to reuse their DNS and TLS sessions
+ * the connections themselves stay warm in the multi handle */
+CURL *net_handles[MAX_TRANSFERS];
+int net_handles_num = 0;
+
+/* servers sharing the same limits, loaded from limits.txt
+ * requests per second and bytes per second are token buckets
+ * refilled by the worker, 0 means no limit
+ * (disk) is the bytes its tiles can take in the disk cache, see diskbudget()
+ * after a few errors in a row the provider is considered down:
+ * its jobs fail at once until a single probe is tried again */
+typedef struct
+{
+	char domain[50];
+	int rps, connections, rate;
+	float requests, bytes;
+	int running, ticks;
+	int errors, down, until, backoff;
+	long long disk;
+} provider;
+provider providers[MAX_PROVIDERS];
+int providers_num = 0;
+
+/* provider of each view */
+char net_provider[CHEAT_VIEWS];
+
+/* network statistics */
+struct
+{
+	int opened, reused, coalesced, cancelled, oversize, preempted, failed;
+	int bytes[PRIO_NUM];
+} net_stats;
+
+/* curl callback to save in memory */
+size_t curl_write(void *ptr, size_t size, size_t nb, void *stream)
+{
+	netbuf *b = stream;
+	int t = nb * size;
+	
+	/* too big, abort the transfer */
+	if (b->size + t > b->max)
+		return 0;
+	
+	if (b->size + t + 1 > b->alloc)
+	{
+		if (b->alloc == 0) b->alloc = 16 * 1024;
+		while (b->size + t + 1 > b->alloc) b->alloc *= 2;
+		b->ptr = realloc(b->ptr, b->alloc);
+	}
+	memcpy(b->ptr + b->size, ptr, t);
+	b->size += t;
+	b->ptr[b->size] = '\0';
+	return t;
+}
+
+/* curl callback to keep the ETag of the tile */
+size_t curl_header(char *ptr, size_t size, size_t nb, void *data)
+{
+	job *j = data;
+	int t = nb * size;
+
+	if (t > 5 && strncasecmp(ptr, "ETag:", 5) == 0)
+	{
+		ptr += 5;
+		t -= 5;
+		while (t > 0 && *ptr == ' ')
+		{
+			ptr++;
+			t--;
+		}
+		while (t > 0 && (ptr[t-1] == '\r' || ptr[t-1] == '\n' || ptr[t-1] == ' '))
+			t--;
+		/* a truncated ETag would never match, forget it */
+		if (t >= sizeof(j->etag)) t = 0;
+		memcpy(j->etag, ptr, t);
+		j->etag[t] = '\0';
+	}
+
+	return nb * size;
+}
+
+/* returns an idle curl handle, or a new one with the persistent options */
+CURL *net_handle()
+{
+	CURL *curl;
+
+	if (net_handles_num > 0)
+		return net_handles[--net_handles_num];
+
+	curl = curl_easy_init();
+	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "PSP-Maps " VERSION);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header);
+	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	/* reject the tiles too big as soon as their size is known */
+	curl_easy_setopt(curl, CURLOPT_MAXFILESIZE, (long) NET_MAX_SIZE);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) NET_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) NET_CONNECT_TIMEOUT);
+	/* signals can not be used for timeouts outside of the main thread */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	#if LIBCURL_VERSION_NUM >= 0x071900
+	/* keep idle connections alive between two bursts of tiles */
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	#endif
+	#if LIBCURL_VERSION_NUM >= 0x072f00
+	/* use HTTP/2 when the server offers it over TLS,
+	 * and wait for a connection to multiplex on rather than opening a new one */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	#endif
+	return curl;
+}
+
+/* put back an idle curl handle, counting if its connection was reused */
+void net_release(CURL *curl)
+{
+	long connects = 0;
+
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+	if (connects)
+		net_stats.opened += connects;
+	else
+		net_stats.reused++;
+
+	if (net_handles_num < MAX_TRANSFERS)
+		net_handles[net_handles_num++] = curl;
+	else
+		curl_easy_cleanup(curl);
+}
+
+/* start the transfer for a pending job, called by the worker with net_lock held */
+void net_start(CURLM *multi, job *j)
+{
+	provider *p = &providers[(int) net_provider[(int) j->s]];
+	char request[1024], header[120];
+
+	geturl(request, j->x, j->y, j->z, j->s);
+	DEBUG("geturl('%s')\n", request);
+
+	j->buf.max = NET_MAX_SIZE;
+	j->curl = net_handle();
+
+	/* only download the tile again if it has changed */
+	j->headers = NULL;
+	if (j->refresh && j->match[0])
+	{
+		sprintf(header, "If-None-Match: %s", j->match);
+		j->headers = curl_slist_append(NULL, header);
+	}
+	j->etag[0] = '\0';
+	curl_easy_setopt(j->curl, CURLOPT_HTTPHEADER, j->headers);
+	curl_easy_setopt(j->curl, CURLOPT_TIMECONDITION, (long) (j->refresh && j->modified ? CURL_TIMECOND_IFMODSINCE : CURL_TIMECOND_NONE));
+	curl_easy_setopt(j->curl, CURLOPT_TIMEVALUE, (long) j->modified);
+
+	#if LIBCURL_VERSION_NUM >= 0x070f05
+	/* a single big tile should not exceed the bandwidth of its provider either */
+	curl_easy_setopt(j->curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t) p->rate);
+	#endif
+
+	curl_easy_setopt(j->curl, CURLOPT_URL, request);
+	curl_easy_setopt(j->curl, CURLOPT_WRITEDATA, &j->buf);
+	curl_easy_setopt(j->curl, CURLOPT_HEADERDATA, j);
+	curl_easy_setopt(j->curl, CURLOPT_PRIVATE, j);
+	curl_multi_add_handle(multi, j->curl);
+
+	j->state = JOB_RUNNING;
+	net_running++;
+	p->running++;
+	if (p->rps) p->requests--;
+}
+
+/* stop a running transfer, called by the worker with net_lock held */
+void net_stop_job(CURLM *multi, job *j)
+{
+	curl_multi_remove_handle(multi, j->curl);
+	curl_slist_free_all(j->headers);
+	j->headers = NULL;
+	net_release(j->curl);
+	j->curl = NULL;
+	net_running--;
+	providers[(int) net_provider[(int) j->s]].running--;
+}
+
+/* wait for activity on the transfers, or for a short timeout */
+void net_wait(CURLM *multi)
+{
+	#if LIBCURL_VERSION_NUM >= 0x071c00
+	curl_multi_wait(multi, NULL, 0, 50, NULL);
+	#else
+	fd_set r, w, e;
+	int max = -1;
+	struct timeval t = {0, 50000};
+	FD_ZERO(&r);
+	FD_ZERO(&w);
+	FD_ZERO(&e);
+	curl_multi_fdset(multi, &r, &w, &e, &max);
+	if (max < 0)
+		SDL_Delay(50);
+	else
+		select(max + 1, &r, &w, &e, &t);
+	#endif
+}
+
+/* refill the buckets of the providers, called with net_lock held */
+void net_refill()
+{
+	provider *p;
+	int i, now = SDL_GetTicks();
+
+	for (i = 0; i < providers_num; i++)
+	{
+		p = &providers[i];
+		/* a clock started again counts from now */
+		if (now < p->ticks) p->ticks = now;
+		/* allow bursts of one second */
+		p->requests += (float) p->rps * (now - p->ticks) / 1000;
+		if (p->requests > p->rps) p->requests = p->rps;
+		p->bytes += (float) p->rate * (now - p->ticks) / 1000;
+		if (p->bytes > p->rate) p->bytes = p->rate;
+		p->ticks = now;
+	}
+}
+
+/* returns 1 if the provider of the view (s) has a free connection */
+int net_connection(int s)
+{
+	provider *p = &providers[(int) net_provider[s]];
+	return !p->connections || p->running < p->connections;
+}
+
+/* returns 1 if the provider of the view (s) allows one more request now */
+int net_budget(int s)
+{
+	provider *p = &providers[(int) net_provider[s]];
+	if (p->rps && p->requests < 1) return 0;
+	if (p->rate && p->bytes <= 0) return 0;
+	return 1;
+}
+
+/* returns 1 if the provider of the view (s) is down and should not be tried now */
+int net_down(int s)
+{
+	provider *p = &providers[(int) net_provider[s]];
+	return p->down && (int) (p->until - SDL_GetTicks()) > 0;
+}
+
+/* returns 1 if a transfer can start now for the view (s)
+ * a provider that was down gets a single probe */
+int net_allowed(int s)
+{
+	provider *p = &providers[(int) net_provider[s]];
+	if (p->down && (net_down(s) || p->running)) return 0;
+	return net_connection(s) && net_budget(s);
+}
+
+/* count the result of a transfer for the provider of the view (s)
+ * network errors and server errors open the circuit, with an exponential backoff */
+void net_health(int s, int error)
+{
+	provider *p = &providers[(int) net_provider[s]];
+
+	if (!error)
+	{
+		if (p->down) DEBUG("provider %s is up\n", p->domain);
+		p->errors = p->down = 0;
+		p->backoff = NET_BACKOFF;
+		return;
+	}
+	if (++p->errors < NET_ERRORS && !p->down) return;
+	if (p->down)
+		p->backoff = p->backoff * 2 > MAX_BACKOFF ? MAX_BACKOFF : p->backoff * 2;
+	p->down = 1;
+	p->until = SDL_GetTicks() + p->backoff;
+	DEBUG("provider %s is down for %d ms\n", p->domain, p->backoff);
+}
+
+/* returns the most urgent pending job allowed to start, or NULL
+ * called with net_lock held */
+job *net_next()
+{
+	job *j, *best = NULL;
+
+	for (j = jobs; j; j = j->next)
+		if (j->state == JOB_PENDING && (best == NULL || j->prio < best->prio) && net_allowed(j->s))
+			best = j;
+	return best;
+}
+
+/* returns the most urgent pending job of the viewport waiting for a connection,
+ * and in (bulk) a running bulk transfer that could give it its place, or NULL
+ * called with net_lock held */
+job *net_blocked(job **bulk)
+{
+	job *j, *b;
+
+	for (j = jobs; j; j = j->next)
+		if (j->state == JOB_PENDING && j->prio <= PRIO_RING && net_budget(j->s) && !providers[(int) net_provider[(int) j->s]].down)
+			for (b = jobs; b; b = b->next)
+				if (b->state == JOB_RUNNING && b->prio == PRIO_BULK && !b->cancel)
+					/* the provider of the bulk transfer must be the one that is full */
+					if (net_connection(j->s) ? net_running >= config.transfers : net_provider[(int) b->s] == net_provider[(int) j->s])
+					{
+						*bulk = b;
+						return j;
+					}
+	return NULL;
+}
+
+/* returns the index of the provider for domain (d), added if needed */
+int net_domain(char *d)
+{
+	int i;
+
+	for (i = 0; i < providers_num; i++)
+		if (strcmp(providers[i].domain, d) == 0)
+			return i;
+	if (providers_num == MAX_PROVIDERS)
+		return 0;
+	/* not in limits.txt, use the default limits */
+	providers[i] = providers[0];
+	strcpy(providers[i].domain, d);
+	return providers_num++;
+}
+
+/* load the limits of the providers, and find the provider of each view
+ * a provider is the domain of the servers, like "google.com" */
+void net_limits()
+{
+	FILE *f;
+	char buffer[100], domain[50], *h, *e, *d;
+	int i, rps, connections, rate, disk;
+
+	SDL_LockMutex(net_lock);
+	strcpy(providers[0].domain, "default");
+	providers[0].rps = NET_RPS;
+	providers[0].connections = NET_CONNECTIONS;
+	providers[0].rate = 0;
+	providers[0].disk = 0;
+	providers_num = 1;
+
+	/* domain, requests per second, connections, KB per second, and optionally MB of disk cache */
+	if ((f = fopen("limits.txt", "r")) != NULL)
+	{
+		while (fgets(buffer, sizeof(buffer), f) != NULL)
+		{
+			disk = 0;
+			if (buffer[0] != '#' && sscanf(buffer, "%49s %d %d %d %d", domain, &rps, &connections, &rate, &disk) >= 4)
+			{
+				i = net_domain(domain);
+				providers[i].rps = rps;
+				providers[i].connections = connections;
+				providers[i].rate = rate * 1024;
+				providers[i].disk = disk > 0 ? disk * 1048576LL : 0;
+			}
+		}
+		fclose(f);
+	}
+
+	for (i = 0; i < CHEAT_VIEWS; i++)
+	{
+		net_provider[i] = 0;
+		if (_url[i] == NULL || (h = strstr(_url[i], "://")) == NULL) continue;
+		h += 3;
+		/* keep the last two parts of the host name */
+		for (e = h; *e && *e != '/' && *e != ':'; e++);
+		if (e - h >= sizeof(domain)) continue;
+		memcpy(domain, h, e - h);
+		domain[e - h] = '\0';
+		/* but the whole address for an IP address */
+		if ((d = strrchr(domain, '.')) == NULL) continue;
+		if (strspn(domain, "0123456789.") == strlen(domain)) d = domain;
+		while (d > domain && d[-1] != '.') d--;
+		net_provider[i] = net_domain(d);
+	}
+
+	for (i = 0; i < providers_num; i++)
+	{
+		providers[i].requests = providers[i].rps;
+		providers[i].bytes = providers[i].rate;
+		providers[i].ticks = SDL_GetTicks();
+		providers[i].backoff = NET_BACKOFF;
+		DEBUG("provider %s: %d requests/s, %d connections, %d bytes/s, %d MB on disk\n", providers[i].domain, providers[i].rps, providers[i].connections, providers[i].rate, (int) (providers[i].disk / 1048576));
+	}
+	SDL_UnlockMutex(net_lock);
+}
+
+/* worker thread: starts queued jobs and completes finished transfers */
+int net_worker(void *unused)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	CURLcode result;
+	long code, filetime;
+	job *j, *b;
+	int running, left;
+
+	multi = curl_multi_init();
+	#if LIBCURL_VERSION_NUM >= 0x071e00
+	/* enough warm connections for every load balancing server */
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) MAX_TRANSFERS * 4);
+	#endif
+	#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX);
+	#endif
+
+	SDL_LockMutex(net_lock);
+	while (!net_stop)
+	{
+		/* abort the transfers that were cancelled */
+		for (j = jobs; j; j = j->next)
+			if (j->state == JOB_RUNNING && j->cancel)
+			{
+				net_stop_job(multi, j);
+				j->state = JOB_DONE;
+			}
+
+		/* fail at once the jobs of the providers that are down, or without such tile */
+		for (j = jobs; j; j = j->next)
+			if (j->state == JOB_PENDING && (net_down(j->s) || !source_has(j->z, j->s)))
+			{
+				net_stats.failed++;
+				j->ok = 0;
+				j->state = JOB_DONE;
+			}
+
+		/* start new transfers while there are free slots, most urgent first */
+		net_refill();
+		while (net_running < config.transfers && (j = net_next()) != NULL)
+			net_start(multi, j);
+
+		/* the viewport does not wait for a cache sweep: put back a bulk transfer */
+		while ((j = net_blocked(&b)) != NULL)
+		{
+			DEBUG("net_preempt(%d, %d, %d, %d)\n", b->x, b->y, b->z, b->s);
+			net_stats.preempted++;
+			net_stop_job(multi, b);
+			b->buf.size = 0;
+			b->state = JOB_PENDING;
+			net_start(multi, j);
+		}
+
+		/* nothing to do, sleep until a new request
+		 * or until the providers allow the pending jobs */
+		if (!net_running)
+		{
+			if (net_jobs)
+				SDL_CondWaitTimeout(net_cond, net_lock, 50);
+			else
+				SDL_CondWait(net_cond, net_lock);
+			continue;
+		}
+		SDL_UnlockMutex(net_lock);
+
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+			if (msg->msg == CURLMSG_DONE)
+			{
+				result = msg->data.result;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &j);
+				curl_easy_getinfo(j->curl, CURLINFO_RESPONSE_CODE, &code);
+				curl_easy_getinfo(j->curl, CURLINFO_FILETIME, &filetime);
+				SDL_LockMutex(net_lock);
+				net_stop_job(multi, j);
+				j->code = code;
+				j->modified = filetime > 0 ? filetime : 0;
+				if (providers[(int) net_provider[(int) j->s]].rate)
+					providers[(int) net_provider[(int) j->s]].bytes -= j->buf.size;
+				/* if there was a network error, invalidate the buffer */
+				j->ok = result == CURLE_OK;
+				if (result == CURLE_WRITE_ERROR || result == CURLE_FILESIZE_EXCEEDED)
+					net_stats.oversize++;
+				else
+					net_health(j->s, result != CURLE_OK || code >= 500 || code == 429);
+				net_stats.bytes[(int) j->prio] += j->buf.size;
+				j->state = JOB_DONE;
+				SDL_UnlockMutex(net_lock);
+			}
+
+		net_wait(multi);
+		SDL_LockMutex(net_lock);
+	}
+
+	/* abort the transfers still running, as the cancelled ones */
+	for (j = jobs; j; j = j->next)
+		if (j->state == JOB_RUNNING)
+		{
+			net_stop_job(multi, j);
+			j->state = JOB_DONE;
+		}
+	SDL_UnlockMutex(net_lock);
+
+	while (net_handles_num > 0)
+		curl_easy_cleanup(net_handles[--net_handles_num]);
+	curl_multi_cleanup(multi);
+	DEBUG("connections: %d opened, %d reused\n", net_stats.opened, net_stats.reused);
+	return 0;
+}
+
+/* returns the job for tile (x,y,z,s) if it is in progress, or NULL
+ * called with net_lock held */
+job *net_find(int x, int y, int z, int s)
+{
+	job *j;
+
+	j = net_table[tilehash(tilekey(x, y, z, s)) % NET_HASH];
+	while (j && (j->x != x || j->y != y || j->z != z || j->s != s))
+		j = j->hnext;
+	return j;
+}
+
+/* returns the job for tile (x,y,z,s) with priority (prio), queued if needed
+ * if the tile is already in progress, share the same transfer
+ * called with net_lock held */
+job *net_add(int x, int y, int z, int s, int prio)
+{
+	job *j, **bucket;
+
+	if ((j = net_find(x, y, z, s)) != NULL)
+	{
+		net_stats.coalesced++;
+		/* the first request since the view changed sets the priority */
+		if (j->gen != net_gen || prio < j->prio)
+			j->prio = prio;
+		j->gen = net_gen;
+		if (prio == PRIO_VISIBLE) j->show = 1;
+		if (prio == PRIO_BULK) j->bulk = 1;
+		if (!j->cancel)
+			return j;
+		/* too late, it is being cancelled: queue it again */
+		net_stats.coalesced--;
+	}
+
+	DEBUG("net_request(%d, %d, %d, %d)\n", x, y, z, s);
+	j = malloc(sizeof(job));
+	bzero(j, sizeof(job));
+	j->x = x;
+	j->y = y;
+	j->z = z;
+	j->s = s;
+	j->state = JOB_PENDING;
+	j->prio = prio;
+	j->gen = net_gen;
+	j->show = prio == PRIO_VISIBLE;
+	j->bulk = prio == PRIO_BULK;
+	*jobs_last = j;
+	jobs_last = &j->next;
+	bucket = &net_table[tilehash(tilekey(x, y, z, s)) % NET_HASH];
+	j->hnext = *bucket;
+	*bucket = j;
+	net_jobs++;
+
+	SDL_CondSignal(net_cond);
+	return j;
+}
+
+/* queue the download of tile (x,y,z,s) with priority (prio)
+ * only visible tiles go to the memory cache, the others only go to disk */
+void net_request(int x, int y, int z, int s, int prio)
+{
+	SDL_LockMutex(net_lock);
+	net_add(x, y, z, s, prio);
+	SDL_UnlockMutex(net_lock);
+}
+
+/* queue a conditional download to refresh the tile (x,y,z,s) already on disk
+ * the tile is shown from disk meanwhile: it waits like a sweep, and is not cancelled when the view moves */
+void net_refresh(int x, int y, int z, int s, char *etag, unsigned int modified)
+{
+	job *j;
+
+	SDL_LockMutex(net_lock);
+	if ((j = net_find(x, y, z, s)) == NULL || j->cancel)
+	{
+		DEBUG("net_refresh(%d, %d, %d, %d)\n", x, y, z, s);
+		j = net_add(x, y, z, s, PRIO_BULK);
+		j->refresh = 1;
+		strcpy(j->match, etag);
+		j->modified = modified;
+	}
+	SDL_UnlockMutex(net_lock);
+}
+
+/* remove a job from the list and the table, called with net_lock held */
+void net_unlink(job *j, job **prev)
+{
+	job **bucket;
+
+	*prev = j->next;
+	if (jobs_last == &j->next)
+		jobs_last = prev;
+	for (bucket = &net_table[tilehash(tilekey(j->x, j->y, j->z, j->s)) % NET_HASH]; *bucket != j; bucket = &(*bucket)->hnext);
+	*bucket = j->hnext;
+	net_jobs--;
+}
+
+/* the view has changed: from now on, jobs not requested again are stale */
+void net_view()
+{
+	SDL_LockMutex(net_lock);
+	net_gen++;
+	SDL_UnlockMutex(net_lock);
+}
+
+/* cancel the stale jobs, except the ones for a cache sweep */
+void net_cancel()
+{
+	job *j, **prev;
+
+	SDL_LockMutex(net_lock);
+	prev = &jobs;
+	while ((j = *prev) != NULL)
+	{
+		if (j->gen == net_gen || j->bulk || j->cancel || j->state == JOB_DONE)
+		{
+			prev = &j->next;
+			continue;
+		}
+		DEBUG("net_cancel(%d, %d, %d, %d)\n", j->x, j->y, j->z, j->s);
+		net_stats.cancelled++;
+		if (j->state == JOB_RUNNING)
+		{
+			/* the worker aborts it */
+			j->cancel = 1;
+			prev = &j->next;
+			continue;
+		}
+		net_unlink(j, prev);
+		free(j);
+	}
+	SDL_CondSignal(net_cond);
+	SDL_UnlockMutex(net_lock);
+}
+
+/* returns the next finished job, or NULL */
+job *net_done()
+{
+	job *j, **prev;
+
+	SDL_LockMutex(net_lock);
+	for (prev = &jobs; (j = *prev) != NULL; prev = &j->next)
+		if (j->state == JOB_DONE)
+		{
+			net_unlink(j, prev);
+			break;
+		}
+	SDL_UnlockMutex(net_lock);
+
+	return j;
+}
+
+/* release a job returned by net_done() */
+void net_free(job *j)
+{
+	free(j->buf.ptr);
+	free(j);
+}
+
+/* tiles that failed recently, retried after an exponential backoff
+ * only used by the main thread, a new failure replaces an older one in its slot */
+struct
+{
+	unsigned long long key;
+	int until, backoff;
+} net_failed[NET_FAILED];
+
+/* returns 1 if the tile (x,y,z,s) failed recently and should not be requested */
+int net_failing(int x, int y, int z, int s)
+{
+	unsigned long long key = tilekey(x, y, z, s);
+	int i = tilehash(key) % NET_FAILED;
+	return net_failed[i].backoff && net_failed[i].key == key && (int) (net_failed[i].until - SDL_GetTicks()) > 0;
+}
+
+/* remember that the tile (x,y,z,s) failed, doubling its backoff if it failed before */
+void net_fail(int x, int y, int z, int s)
+{
+	unsigned long long key = tilekey(x, y, z, s);
+	int i = tilehash(key) % NET_FAILED;
+
+	if (net_failed[i].backoff && net_failed[i].key == key)
+		net_failed[i].backoff = net_failed[i].backoff * 2 > MAX_BACKOFF ? MAX_BACKOFF : net_failed[i].backoff * 2;
+	else
+		net_failed[i].backoff = NET_BACKOFF;
+	net_failed[i].key = key;
+	net_failed[i].until = SDL_GetTicks() + net_failed[i].backoff;
+}
+
+/* forget a failure of the tile (x,y,z,s) */
+void net_forget(int x, int y, int z, int s)
+{
+	unsigned long long key = tilekey(x, y, z, s);
+	int i = tilehash(key) % NET_FAILED;
+
+	if (net_failed[i].key == key)
+		net_failed[i].backoff = 0;
+}
+
+/* returns the number of jobs not handled yet */
+int net_pending()
+{
+	return net_jobs;
+}
+
+void net_init()
+{
+	net_lock = SDL_CreateMutex();
+	net_cond = SDL_CreateCond();
+	net_thread = SDL_CreateThread(net_worker, NULL);
+}
+
+void net_quit()
+{
+	job *j;
+
+	if (net_thread == NULL) return;
+
+	SDL_LockMutex(net_lock);
+	net_stop = 1;
+	SDL_CondSignal(net_cond);
+	SDL_UnlockMutex(net_lock);
+	SDL_WaitThread(net_thread, NULL);
+	net_thread = NULL;
+
+	while ((j = net_done()) != NULL)
+		net_free(j);
+	while (jobs)
+	{
+		j = jobs->next;
+		net_free(jobs);
+		jobs = j;
+	}
+}
@@ -0,0 +1,784 @@
+/* storage of the disk cache: the tiles are appended to a few big pack files
+ * instead of one file per tile (cache/NNN/NNN.dat of the previous versions)
+ *
+ * cache/pack.NNN holds records: a header, the ETag and the tile data
+ * a disk entry points to its record (pack, offset, size)
+ * the packs are read through mmap where available, and the tiles are decoded
+ * straight from the mapping
+ * a replaced tile leaves a dead record, the packs that are mostly dead records
+ * are compacted in background: their live records are moved to the current pack
+ * a compacted pack is only deleted once the index is saved without it
+ * several processes can share the packs (see index.c): each one appends to its own pack,
+ * and one of them compacts the packs the others are not writing */
+
+#define PACK_MAGIC 0x454c4954
+#define PACK_NUM 1000
+#if defined(_PSP_FW_VERSION) || defined(GP2X)
+#define PACK_SIZE (8 * 1024 * 1024)
+#else
+#define PACK_SIZE (64 * 1024 * 1024)
+#endif
+#define PACK_NONE -2
+#define PACK_LEGACY -1
+#define PACK_BATCH 1024
+#define PACK_MOVES 16
+#define PACK_IDLE 1000
+
+/* formats of the tile data: as downloaded, or decoded pixels (see tile.c) */
+enum
+{
+	PACK_IMAGE,
+	PACK_PIXELS,
+	PACK_LZ4,
+	PACK_FORMATS
+};
+
+/* choices of the menu, from the smallest to the fastest to load */
+#ifdef HAVE_LZ4
+#define DISK_FORMATS PACK_FORMATS
+#else
+#define DISK_FORMATS PACK_LZ4
+#endif
+char *_disk_format[PACK_FORMATS] = {"Images (small)", "Pixels (fast)", "LZ4 pixels"};
+
+/* header of a record, followed by the ETag and the tile data */
+typedef struct
+{
+	unsigned int magic, size;
+	int x, y;
+	char z, s, etag, format;
+	unsigned int fetched, modified;
+} record;
+
+/* length of a record, the headers are kept aligned */
+#define PACK_LENGTH(etag, size) ((sizeof(record) + (etag) + (size) + 3) & ~3)
+/* length of the record of the own ETag of the entry (i), if any */
+#define PACK_TAG(i) (disk[i].tag ? PACK_LENGTH(disk[i].tag_length, 0) : 0)
+
+struct
+{
+	/* bytes written, and bytes of the records still in the cache */
+	int size, live;
+	/* compacted, to delete when the index is saved */
+	char retired;
+	char *map;
+	/* times it was started by any process, its mapping is for an older file if it changed */
+	int born;
+} pack[PACK_NUM];
+
+/* bytes of the live records of all the packs, and of the tiles of each provider
+ * a record shared by identical tiles is counted once in the total, but for each tile in its provider
+ * the tiles of the previous versions are counted in their provider, and in the total once moved */
+long long pack_bytes = 0, pack_used[MAX_PROVIDERS];
+
+/* pack being written */
+int pack_cur = -1;
+FILE *pack_file = NULL;
+
+/* entries still in the files of the previous versions */
+int pack_legacy = 0;
+
+/* keep the packs nothing uses, for pspmaps --verify to find their tiles */
+int pack_keep = 0;
+
+/* compaction, shared with the worker thread */
+int pack_from = PACK_NONE, pack_scan = 0, pack_stop = 0;
+SDL_cond *pack_cond;
+SDL_Thread *pack_thread = NULL;
+
+/* the disk cache is held by one thread at a time, nested (disk_lock(), see index.c)
+ * pack_lock only guards the holder, the display can try it without waiting for the storage */
+SDL_mutex *pack_lock = NULL;
+SDL_cond *pack_free;
+Uint32 pack_holder;
+int pack_held = 0;
+
+struct
+{
+	int compacted, moved, migrated;
+} pack_stats;
+
+/* return the disk file name for cache entry of the previous versions
+ * maximum of 1000 entries per folder to improve access speed */
+void diskname(char *buf, int n)
+{
+	sprintf(buf, "cache/%.3d/%.3d.dat", n/1000, n%1000);
+}
+
+/* return the file name of the ETag for cache entry */
+void tagname(char *buf, int n)
+{
+	sprintf(buf, "cache/%.3d/%.3d.tag", n/1000, n%1000);
+}
+
+void packname(char *buf, int p)
+{
+	sprintf(buf, "cache/pack.%.3d", p);
+}
+
+/* returns the content of file (name) and its size in (n), or NULL */
+char *pack_load(char *name, int *n)
+{
+	FILE *f;
+	char *data;
+
+	if ((f = fopen(name, "rb")) == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(*n + 1);
+	if (*n <= 0 || fread(data, 1, *n, f) != *n)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+/* returns the size of the pack (p), the other processes write to the packs too */
+int pack_size(int p)
+{
+	#ifdef INDEX_SHARED
+	struct stat st;
+	char name[50];
+
+	packname(name, p);
+	pack[p].size = stat(name, &st) == 0 ? st.st_size : 0;
+	#endif
+	return pack[p].size;
+}
+
+/* unmap the pack (p) */
+void pack_unmap(int p)
+{
+	#ifdef PACK_MMAP
+	if (pack[p].map != NULL)
+		munmap(pack[p].map, PACK_SIZE);
+	#endif
+	pack[p].map = NULL;
+}
+
+/* return the record at (offset) of the pack (p), of (length) bytes, or NULL
+ * it is read from the mapping, or else into (*buf) which must be freed */
+record *pack_record(int p, int offset, int length, char **buf)
+{
+	FILE *f;
+	char name[50];
+
+	*buf = NULL;
+	if (p < 0 || p >= PACK_NUM || pack[p].retired || offset < 0
+		|| (offset + length > pack[p].size && offset + length > pack_size(p)))
+		return NULL;
+
+	#ifdef PACK_MMAP
+	if (pack[p].map == NULL)
+	{
+		int fd;
+		packname(name, p);
+		if ((fd = open(name, O_RDONLY)) >= 0)
+		{
+			/* the whole pack size is mapped, the records appended later show up in it */
+			pack[p].map = mmap(NULL, PACK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+			if (pack[p].map == MAP_FAILED)
+				pack[p].map = NULL;
+			close(fd);
+		}
+	}
+	if (pack[p].map != NULL)
+		return (record *) (pack[p].map + offset);
+	#endif
+
+	/* no mapping: read it */
+	packname(name, p);
+	if ((f = fopen(name, "rb")) == NULL)
+		return NULL;
+	*buf = malloc(length);
+	if (fseek(f, offset, SEEK_SET) != 0 || fread(*buf, 1, length, f) != length)
+	{
+		free(*buf);
+		*buf = NULL;
+	}
+	fclose(f);
+	return (record *) *buf;
+}
+
+/* return the record of the entry (i), or NULL if it is missing or does not match */
+record *pack_entry(int i, char **buf)
+{
+	record *r;
+
+	r = pack_record(disk[i].pack, disk[i].offset, PACK_LENGTH(disk[i].etag, disk[i].size), buf);
+	/* a record of another tile with the same content, see dedup.c */
+	if (r != NULL && (r->magic != PACK_MAGIC || r->size != disk[i].size || r->etag != disk[i].etag
+		|| ((r->x != disk[i].x || r->y != disk[i].y || r->z != disk[i].z || r->s != disk[i].s)
+			&& dedup_of(i) == NULL)))
+	{
+		DEBUG("pack: bad record for entry %d\n", i);
+		free(*buf);
+		*buf = NULL;
+		r = NULL;
+	}
+	return r;
+}
+
+/* return the data of the tile of entry (i), its size in (n) and its format in (format), or NULL
+ * the data is in the mapping if possible, else (*copy) is set and the data must be freed
+ * the pack lock must be held while the data is used */
+char *pack_data(int i, int *n, int *format, int *copy)
+{
+	record *r;
+	char name[50], *buf;
+
+	*copy = 0;
+	*format = PACK_IMAGE;
+	if (disk[i].pack == PACK_LEGACY)
+	{
+		diskname(name, i);
+		*copy = 1;
+		return pack_load(name, n);
+	}
+	if ((r = pack_entry(i, &buf)) == NULL)
+		return NULL;
+	*n = r->size;
+	*format = r->format;
+	/* keep the data of the record at the start of the buffer */
+	if ((*copy = buf != NULL))
+		memmove(buf, (char *) (r + 1) + r->etag, r->size);
+	return buf != NULL ? buf : (char *) (r + 1) + r->etag;
+}
+
+/* return the record of the own ETag of the entry (i), or NULL if it is missing or does not match */
+record *pack_tagrecord(int i, char **buf)
+{
+	record *r;
+
+	r = pack_record(disk[i].tag - 1, disk[i].tag_offset, PACK_TAG(i), buf);
+	if (r != NULL && (r->magic != PACK_MAGIC || r->size || r->etag != disk[i].tag_length
+		|| r->x != disk[i].x || r->y != disk[i].y || r->z != disk[i].z || r->s != disk[i].s))
+	{
+		DEBUG("pack: bad ETag record for entry %d\n", i);
+		free(*buf);
+		*buf = NULL;
+		r = NULL;
+	}
+	return r;
+}
+
+/* read in (etag) the ETag of the tile of entry (i), if any */
+void pack_etag(int i, char *etag)
+{
+	FILE *f;
+	record *r;
+	char name[50], *buf;
+
+	etag[0] = '\0';
+	if (disk[i].tag)
+	{
+		if ((r = pack_tagrecord(i, &buf)) != NULL)
+		{
+			memcpy(etag, r + 1, r->etag);
+			etag[(int) r->etag] = '\0';
+		}
+		free(buf);
+		return;
+	}
+	if (!disk[i].etag) return;
+	if (disk[i].pack == PACK_LEGACY)
+	{
+		tagname(name, i);
+		if ((f = fopen(name, "r")) != NULL)
+		{
+			if (fgets(etag, 100, f) == NULL)
+				etag[0] = '\0';
+			fclose(f);
+		}
+		return;
+	}
+	if ((r = pack_entry(i, &buf)) == NULL)
+		return;
+	memcpy(etag, r + 1, r->etag);
+	etag[(int) r->etag] = '\0';
+	free(buf);
+}
+
+/* close the current pack, the next record starts a new one */
+void pack_close()
+{
+	if (pack_file != NULL)
+		fclose(pack_file);
+	if (pack_cur >= 0)
+		index_release(pack_cur);
+	pack_file = NULL;
+	pack_cur = -1;
+}
+
+/* append the record (r) with its ETag and data to the current pack
+ * returns its offset in the pack (pack_cur), or -1 */
+int pack_append(record *r, char *etag, char *data)
+{
+	static char pad[4];
+	int length = PACK_LENGTH(r->etag, r->size), offset, p;
+	char name[50];
+
+	/* start a new pack when the current one is full */
+	if (pack_cur >= 0 && pack[pack_cur].size && pack[pack_cur].size + length > PACK_SIZE)
+		pack_close();
+	if (pack_file == NULL)
+	{
+		if (pack_cur < 0)
+			for (p = 0; p < PACK_NUM && pack_cur < 0; p++)
+				if (!pack_size(p) && !pack[p].retired && index_claim(p))
+					pack_cur = p;
+		if (pack_cur < 0)
+		{
+			DEBUG("pack: no free pack!\n");
+			return -1;
+		}
+		packname(name, pack_cur);
+		if ((pack_file = fopen(name, "ab")) == NULL)
+		{
+			pack_cur = -1;
+			return -1;
+		}
+	}
+
+	offset = pack[pack_cur].size;
+	if (fwrite(r, sizeof(record), 1, pack_file) != 1
+		|| fwrite(etag, 1, r->etag, pack_file) != r->etag
+		|| fwrite(data, 1, r->size, pack_file) != r->size
+		|| fwrite(pad, 1, length - sizeof(record) - r->etag - r->size, pack_file) != length - sizeof(record) - r->etag - r->size
+		|| fflush(pack_file) != 0)
+	{
+		/* disk full? the end of this pack is unknown now, forget it */
+		DEBUG("pack: cannot write pack %d\n", pack_cur);
+		pack[pack_cur].size = PACK_SIZE;
+		pack_close();
+		return -1;
+	}
+	pack[pack_cur].size += length;
+	pack[pack_cur].live += length;
+	pack_bytes += length;
+	return offset;
+}
+
+/* write the tile (data) of (n) bytes in (format) with its (etag) for the entry (i)
+ * returns 0 if it could not be saved */
+int pack_write(int i, char *data, int n, int format, char *etag)
+{
+	record r;
+	int offset;
+
+	r.magic = PACK_MAGIC;
+	r.size = n;
+	r.x = disk[i].x;
+	r.y = disk[i].y;
+	r.z = disk[i].z;
+	r.s = disk[i].s;
+	r.etag = strlen(etag) < 100 ? strlen(etag) : 0;
+	r.format = format;
+	r.fetched = disk[i].fetched;
+	r.modified = disk[i].modified;
+	if ((offset = pack_append(&r, etag, data)) < 0)
+		return 0;
+	disk[i].pack = pack_cur;
+	disk[i].offset = offset;
+	disk[i].size = n;
+	disk[i].etag = r.etag;
+	return 1;
+}
+
+/* the entry (i) shares the record of a tile with another ETag than its (etag):
+ * it is written in a record without data, returns 0 if it could not be saved */
+int pack_tag(int i, char *etag)
+{
+	record r;
+	int offset;
+
+	r.magic = PACK_MAGIC;
+	r.size = 0;
+	r.x = disk[i].x;
+	r.y = disk[i].y;
+	r.z = disk[i].z;
+	r.s = disk[i].s;
+	r.etag = strlen(etag) < 100 ? strlen(etag) : 0;
+	r.format = PACK_IMAGE;
+	r.fetched = disk[i].fetched;
+	r.modified = disk[i].modified;
+	if ((offset = pack_append(&r, etag, etag)) < 0)
+		return 0;
+	disk[i].tag = pack_cur + 1;
+	disk[i].tag_offset = offset;
+	disk[i].tag_length = r.etag;
+	return 1;
+}
+
+/* forget the own ETag of the entry (i) */
+void pack_untag(int i)
+{
+	if (disk[i].tag > 0 && disk[i].tag <= PACK_NUM)
+	{
+		pack[disk[i].tag - 1].live -= PACK_TAG(i);
+		pack_bytes -= PACK_TAG(i);
+		pack_used[(int) net_provider[(int) disk[i].s]] -= PACK_TAG(i);
+	}
+	disk[i].tag = 0;
+}
+
+/* delete the files of the entry (i) of the previous versions */
+void pack_unlink(int i)
+{
+	char name[50];
+
+	diskname(name, i);
+	unlink(name);
+	tagname(name, i);
+	unlink(name);
+	pack_legacy--;
+}
+
+/* the record of the entry (i) is replaced or removed
+ * a record shared with other tiles stays until the last one goes */
+void pack_drop(int i)
+{
+	blob *b;
+	int p, length = PACK_LENGTH(disk[i].etag, disk[i].size);
+
+	if (disk[i].pack == PACK_LEGACY)
+	{
+		pack_unlink(i);
+		pack_used[(int) net_provider[(int) disk[i].s]] -= length;
+	}
+	else if (disk[i].pack >= 0 && disk[i].pack < PACK_NUM)
+	{
+		p = disk[i].pack;
+		if ((b = dedup_of(i)) != NULL)
+		{
+			p = b->pack;
+			if (!dedup_release(b))
+				p = PACK_NONE;
+		}
+		if (p != PACK_NONE)
+		{
+			pack[p].live -= length;
+			pack_bytes -= length;
+		}
+		pack_used[(int) net_provider[(int) disk[i].s]] -= length;
+	}
+	pack_untag(i);
+	disk[i].pack = PACK_NONE;
+	disk[i].hash = 0;
+}
+
+/* count the live records of every pack, after loading or resizing the cache
+ * and the entries that use each record, the shared ones are counted once */
+void pack_count()
+{
+	int i, p;
+	blob *b;
+
+	for (p = 0; p < PACK_NUM; p++)
+		pack[p].live = 0;
+	for (p = 0; p < MAX_PROVIDERS; p++)
+		pack_used[p] = 0;
+	pack_bytes = 0;
+	pack_legacy = 0;
+	dedup_reset();
+	for (i = 0; i < config.cache_size; i++)
+		if (!disk[i].fetched);
+		else if (disk[i].pack == PACK_LEGACY)
+		{
+			pack_legacy++;
+			pack_used[(int) net_provider[(int) disk[i].s]] += PACK_LENGTH(disk[i].etag, disk[i].size);
+		}
+		else if (disk[i].pack >= 0 && disk[i].pack < PACK_NUM)
+		{
+			pack_used[(int) net_provider[(int) disk[i].s]] += PACK_LENGTH(disk[i].etag, disk[i].size);
+			if (disk[i].tag > 0 && disk[i].tag <= PACK_NUM)
+			{
+				pack_used[(int) net_provider[(int) disk[i].s]] += PACK_TAG(i);
+				pack[disk[i].tag - 1].live += PACK_TAG(i);
+				pack_bytes += PACK_TAG(i);
+			}
+			if (disk[i].hash && (b = dedup_find(disk[i].hash, disk[i].pack, disk[i].offset)) != NULL)
+			{
+				dedup_share(b);
+				continue;
+			}
+			if (disk[i].hash)
+				dedup_add(disk[i].hash, disk[i].pack, disk[i].offset, PACK_LENGTH(disk[i].etag, disk[i].size));
+			pack[disk[i].pack].live += PACK_LENGTH(disk[i].etag, disk[i].size);
+			pack_bytes += PACK_LENGTH(disk[i].etag, disk[i].size);
+		}
+}
+
+/* move the record of the entry (i) to the current pack */
+void pack_move(int i)
+{
+	record *r;
+	blob *b;
+	char *buf, *data, etag[100];
+	int n, format, copy, p = disk[i].pack, offset;
+
+	if (p == PACK_LEGACY)
+	{
+		/* a file of the previous versions */
+		pack_etag(i, etag);
+		if ((data = pack_data(i, &n, &format, &copy)) != NULL && pack_write(i, data, n, format, etag))
+		{
+			journal_write(i);
+			pack_unlink(i);
+			pack_stats.migrated++;
+		}
+		free(data);
+		return;
+	}
+
+	/* a shared record already moved for another tile */
+	if (disk[i].hash && (b = dedup_moved(disk[i].hash, p, disk[i].offset)) != NULL)
+	{
+		disk[i].pack = b->pack;
+		disk[i].offset = b->offset;
+		journal_write(i);
+		return;
+	}
+
+	/* the record is copied as is, the index is updated once it is written */
+	if ((r = pack_entry(i, &buf)) == NULL)
+		return;
+	if ((offset = pack_append(r, (char *) (r + 1), (char *) (r + 1) + r->etag)) >= 0)
+	{
+		pack[p].live -= PACK_LENGTH(disk[i].etag, disk[i].size);
+		pack_bytes -= PACK_LENGTH(disk[i].etag, disk[i].size);
+		if (disk[i].hash && (b = dedup_find(disk[i].hash, p, disk[i].offset)) != NULL)
+		{
+			b->from_pack = p;
+			b->from_offset = disk[i].offset;
+			b->pack = pack_cur;
+			b->offset = offset;
+		}
+		disk[i].pack = pack_cur;
+		disk[i].offset = offset;
+		journal_write(i);
+		pack_stats.moved++;
+	}
+	free(buf);
+}
+
+/* move the record of the own ETag of the entry (i) to the current pack
+ * a lost one is forgotten, the ETag of the shared record is sent instead and the server sends the tile again */
+void pack_retag(int i)
+{
+	record *r;
+	char *buf;
+	int p = disk[i].tag - 1, offset;
+
+	if ((r = pack_tagrecord(i, &buf)) == NULL)
+		pack_untag(i);
+	else if ((offset = pack_append(r, (char *) (r + 1), (char *) (r + 1))) >= 0)
+	{
+		pack[p].live -= PACK_TAG(i);
+		pack_bytes -= PACK_TAG(i);
+		disk[i].tag = pack_cur + 1;
+		disk[i].tag_offset = offset;
+		pack_stats.moved++;
+	}
+	journal_write(i);
+	free(buf);
+}
+
+/* make sure the current pack is on the storage, before the index points to its records */
+void pack_sync()
+{
+	if (pack_file != NULL)
+		journal_fsync(pack_file);
+}
+
+/* the pack (p) has no live record left */
+void pack_retire(int p)
+{
+	DEBUG("pack: pack %d compacted\n", p);
+	pack_unmap(p);
+	pack[p].retired = 1;
+	pack[p].live = 0;
+	pack_stats.compacted++;
+}
+
+/* returns the next pack to compact, PACK_LEGACY for the files of the previous versions
+ * or PACK_NONE: the pack with the most dead space, if more than half of it */
+int pack_victim()
+{
+	int p, best = PACK_NONE, dead, most = 0;
+
+	if (pack_legacy > 0) return PACK_LEGACY;
+	for (p = 0; p < PACK_NUM; p++)
+		if (pack_size(p) && !pack[p].retired && p != pack_cur && !index_owned(p))
+		{
+			dead = pack[p].size - pack[p].live;
+			if (dead * 2 > pack[p].size && dead > most)
+			{
+				most = dead;
+				best = p;
+			}
+		}
+	return best;
+}
+
+int pack_worker(void *unused)
+{
+	char name[50];
+	int i, end, moves;
+
+	disk_lock();
+	while (!pack_stop)
+	{
+		/* one process compacts, the pack it compacts is its own until it is retired */
+		if (!index_compactor() || (pack_from == PACK_NONE && (pack_from = pack_victim()) == PACK_NONE)
+			|| (pack_from >= 0 && !index_claim(pack_from)))
+		{
+			pack_from = PACK_NONE;
+			pack_scan = 0;
+			disk_wait(PACK_IDLE);
+			continue;
+		}
+
+		/* move the live records of the next entries, a few at a time */
+		if (pack_from >= 0 && !pack[pack_from].live)
+			pack_scan = config.cache_size;
+		end = pack_scan + PACK_BATCH < config.cache_size ? pack_scan + PACK_BATCH : config.cache_size;
+		for (i = pack_scan, moves = 0; i < end && moves < PACK_MOVES; i++)
+		{
+			if (disk[i].fetched && disk[i].pack == pack_from)
+			{
+				pack_move(i);
+				moves++;
+			}
+			/* and the own ETags written there */
+			if (disk[i].fetched && pack_from >= 0 && disk[i].tag == pack_from + 1)
+			{
+				pack_retag(i);
+				moves++;
+			}
+		}
+		pack_scan = i;
+
+		if (pack_scan >= config.cache_size)
+		{
+			if (pack_from >= 0)
+			{
+				/* and the tiles that shared its records since the scan went past them */
+				for (i = 0; i < config.cache_size; i++)
+				{
+					if (disk[i].fetched && disk[i].pack == pack_from)
+						pack_move(i);
+					if (disk[i].fetched && disk[i].tag == pack_from + 1)
+						pack_retag(i);
+				}
+				pack_retire(pack_from);
+			}
+			else
+			{
+				/* the folders of the previous versions are empty now */
+				for (i = 0; i < config.cache_size; i += 1000)
+				{
+					sprintf(name, "cache/%.3d", i/1000);
+					rmdir(name);
+				}
+				pack_legacy = 0;
+			}
+			pack_from = PACK_NONE;
+			pack_scan = 0;
+		}
+
+		/* let the display, the downloads and the other processes have the disk cache */
+		disk_unlock();
+		SDL_Delay(1);
+		disk_lock();
+	}
+	disk_unlock();
+	return 0;
+}
+
+/* find the packs, the index lock must be held */
+void pack_init()
+{
+	struct stat st;
+	char name[50];
+	int p;
+
+	for (p = 0; p < PACK_NUM; p++)
+	{
+		packname(name, p);
+		pack[p].size = stat(name, &st) == 0 ? st.st_size : 0;
+	}
+	/* counted on exit, see index.c */
+	if (!index_ready)
+		pack_count();
+
+	for (p = 0; p < PACK_NUM; p++)
+		if (pack[p].size && !pack[p].live && !pack_keep && index_alone)
+		{
+			/* compacted or written after the index was saved, nothing uses it */
+			packname(name, p);
+			unlink(name);
+			pack[p].size = 0;
+		}
+		/* keep writing to the emptiest pack */
+		else if (pack[p].size && pack[p].size < PACK_SIZE / 2 && (pack_cur < 0 || pack[p].size < pack[pack_cur].size)
+			&& !index_owned(p))
+			pack_cur = p;
+	if (pack_cur >= 0)
+		index_claim(pack_cur);
+
+	pack_lock = SDL_CreateMutex();
+	pack_cond = SDL_CreateCond();
+	pack_free = SDL_CreateCond();
+}
+
+/* start the compaction, once the index is ready */
+void pack_start()
+{
+	/* pspmaps --verify compacts the packs itself, once it has read them */
+	if (!pack_keep)
+		pack_thread = SDL_CreateThread(pack_worker, NULL);
+}
+
+/* stop the compaction, before saving the index */
+void pack_quit()
+{
+	int p;
+
+	if (pack_thread == NULL) return;
+
+	SDL_LockMutex(pack_lock);
+	pack_stop = 1;
+	SDL_CondSignal(pack_cond);
+	SDL_UnlockMutex(pack_lock);
+	SDL_WaitThread(pack_thread, NULL);
+	pack_thread = NULL;
+
+	disk_lock();
+	pack_close();
+	disk_unlock();
+	for (p = 0; p < PACK_NUM; p++)
+		pack_unmap(p);
+}
+
+/* delete the compacted packs, once the index is saved without them */
+void pack_clean()
+{
+	char name[50];
+	int p;
+
+	for (p = 0; p < PACK_NUM; p++)
+		if (pack[p].retired)
+		{
+			packname(name, p);
+			unlink(name);
+			pack[p].retired = 0;
+			pack[p].size = 0;
+			/* kept from the compaction, no other process writes to it meanwhile */
+			index_release(p);
+		}
+}
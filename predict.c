@@ -0,0 +1,117 @@
+/* predictive prefetch: extrapolates the moves on the map
+ * (joystick, motion kit or GPS track) to download ahead
+ * the tiles the screen is about to reach */
+
+#define PREDICT_LOOKAHEAD 2
+#define MAX_LOOKAHEAD 10
+#define PREDICT_SAMPLE 250
+#define PREDICT_GPS_SAMPLE 1000
+#define PREDICT_STEP 0.5
+#define PREDICT_MIN_SPEED 0.1
+#define PREDICT_HISTORY 64
+
+/* last sampled position and smoothed speed, in tiles per second */
+struct
+{
+	float x, y, vx, vy;
+	int z, ticks;
+} motion;
+
+/* recent predictions, to measure how many of them were really needed */
+struct
+{
+	unsigned long long key;
+	char used, hit;
+} predicted[PREDICT_HISTORY];
+int predicted_idx = 0;
+
+struct
+{
+	int predicted, hits, wasted;
+} predict_stats;
+
+/* sample the current position to update the speed */
+void predict_update()
+{
+	int now = SDL_GetTicks(), dt, sample = PREDICT_SAMPLE;
+
+	/* GPS positions change only once per fix */
+	if (gps_loaded && config.follow_gps)
+		sample = PREDICT_GPS_SAMPLE;
+
+	/* start again from scratch on zoom */
+	if (z != motion.z)
+	{
+		motion.x = x;
+		motion.y = y;
+		motion.z = z;
+		motion.vx = motion.vy = 0;
+		motion.ticks = now;
+		return;
+	}
+
+	dt = now - motion.ticks;
+	if (dt < sample) return;
+
+	/* smooth the speed over the last samples */
+	motion.vx = (motion.vx + (x - motion.x) * 1000 / dt) / 2;
+	motion.vy = (motion.vy + (y - motion.y) * 1000 / dt) / 2;
+	motion.x = x;
+	motion.y = y;
+	motion.ticks = now;
+}
+
+/* remember a predicted tile, forgetting the oldest prediction */
+void predict_remember(int x, int y, int z, int s)
+{
+	unsigned long long key = tilekey(x, y, z, s);
+	int i;
+
+	for (i = 0; i < PREDICT_HISTORY; i++)
+		if (predicted[i].used && predicted[i].key == key)
+			return;
+
+	if (predicted[predicted_idx].used && !predicted[predicted_idx].hit)
+		predict_stats.wasted++;
+	predicted[predicted_idx].key = key;
+	predicted[predicted_idx].used = 1;
+	predicted[predicted_idx].hit = 0;
+	predicted_idx = (predicted_idx + 1) % PREDICT_HISTORY;
+	predict_stats.predicted++;
+}
+
+/* the tile is on screen, count it if it was predicted */
+void predict_hit(int x, int y, int z, int s)
+{
+	unsigned long long key = tilekey(x, y, z, s);
+	int i;
+
+	for (i = 0; i < PREDICT_HISTORY; i++)
+		if (predicted[i].used && !predicted[i].hit && predicted[i].key == key)
+		{
+			predicted[i].hit = 1;
+			predict_stats.hits++;
+		}
+}
+
+/* queue the tiles on the way of the current move
+ * the screen and the ring around it are already handled by display() */
+void predict_prefetch()
+{
+	float t, px, py;
+	int i, j;
+
+	if (!config.lookahead || motion.z != z) return;
+	if (fabs(motion.vx) + fabs(motion.vy) < PREDICT_MIN_SPEED) return;
+
+	for (t = PREDICT_STEP; t <= config.lookahead; t += PREDICT_STEP)
+	{
+		px = x + motion.vx * t;
+		py = y + motion.vy * t;
+		for (j = py-1; j < py+1; j++)
+			for (i = px-1; i < px+1; i++)
+				if (j < (int) (y-2) || j >= y+2 || i < (int) (x-2) || i >= x+2)
+					if (prefetch(i, j, z, PRIO_PREDICT))
+						predict_remember(i, j, z, s);
+	}
+}
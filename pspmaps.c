@@ -26,6 +26,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -36,12 +37,17 @@
 #include <SDL_ttf.h>
 #include <SDL_mixer.h>
 #include <curl/curl.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
 
 #define DEFAULT_MAP 0
 #define DEFAULT_CHEAT_MAP 18
 
 #define BPP 32
-#define BUFFER_SIZE 200 * 1024
 #define MEMORY_CACHE_SIZE 32
 #define DIGITAL_STEP 0.5
 #define JOYSTICK_STEP 0.05
@@ -78,18 +84,28 @@ void quit();
 #define mkdir(D, M) mkdir(D)
 #endif
 
+/* the packs of the disk cache are read through mmap where available,
+ * and the cache can be shared by several processes then */
+#if !defined(_PSP_FW_VERSION) && !defined(_WIN32)
+#define PACK_MMAP
+#define INDEX_SHARED
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#endif
+
 SDL_Surface *screen, *prev, *next;
 SDL_Surface *logo, *na, *zoom;
 SDL_Joystick *joystick;
 TTF_Font *font;
 CURL *curl;
-char response[BUFFER_SIZE];
 int motion_loaded, gps_loaded, dat_loaded = 0;
 
 /* x, y, z are in Google's format: z = [ -4 .. 16 ], x and y = [ 1 .. 2^(17-z) ] */
 int z = 16, s = DEFAULT_MAP;
 float x = 1, y = 1, dx, dy;
-int active = 0, fav = 0, balancing = 0, cache_zoom = 3;
+int active = 0, fav = 0, cache_zoom = 3;
 
 /* cache in memory, for recent history and smooth moves */
 struct
@@ -100,13 +116,47 @@ struct
 } memory[MEMORY_CACHE_SIZE];
 int memory_idx = 0;
 
-/* cache on disk, for offline browsing and to limit requests */
+/* cache on disk, for offline browsing and to limit requests
+ * tiles older than DISK_MAXAGE are refreshed with conditional requests */
+#define DISK_MAXAGE 30 * 24 * 3600
 struct _disk
 {
 	int x, y;
 	char z, s;
+	/* length of the ETag saved with the tile */
+	char etag;
+	/* eviction queue, and time of the last hit, see evict.c */
+	char hot;
+	unsigned int used;
+	/* fetch time and Last-Modified of the tile */
+	unsigned int fetched, modified;
+	/* record of the tile in the packs, see pack.c */
+	short pack;
+	/* record of its own ETag when it shares the record of a tile with another one, see pack_tag()
+	 * its pack + 1 (0 when the ETag of the shared record is its own), offset and length */
+	short tag;
+	int offset, size;
+	/* hash of the content, the records of identical tiles are shared, see dedup.c */
+	unsigned int hash;
+	int tag_offset;
+	char tag_length;
 } *disk;
-int disk_idx = 0;
+
+/* the entries are in the index file, mapped where possible, see index.c
+ * and the tables built from them too, unless they were built since startup */
+char *index_base = NULL;
+size_t index_length = 0;
+int index_ready = 0;
+/* no other process uses the cache */
+int index_alone = 1;
+#define INDEX_HOLDS(p) (index_base != NULL && (char *) (p) >= index_base && (char *) (p) < index_base + index_length)
+
+/* entries of the disk cache before version 2.4.0.0, without validators */
+struct _disk_v0
+{
+	int x, y;
+	char z, s;
+};
 
 /* this is the Google Maps API key used for address search
  * this one was created for a dummy domain
@@ -123,6 +173,11 @@ struct
 	int show_kml;
 	int cheat;
 	int follow_gps;
+	int transfers;
+	int lookahead;
+	int disk_format;
+	int disk_budget;
+	int warm_budget;
 } config;
 
 /* user's favorite places */
@@ -201,6 +256,7 @@ char *_view[CHEAT_VIEWS] = {
 
 /* urls for services, loaded from urls.txt */
 char *_url[CHEAT_VIEWS];
+char *urls_file = "urls.txt";
 
 /* PSP buttons list */
 #ifdef GP2X
@@ -269,27 +325,54 @@ enum
 	MENU_KEYBOARD,
 	MENU_CACHEZOOM,
 	MENU_CACHESIZE,
+	MENU_DISKBUDGET,
+	MENU_WARMBUDGET,
+	MENU_TRANSFERS,
+	MENU_LOOKAHEAD,
+	MENU_DISKFORMAT,
 	MENU_CHEAT,
 	MENU_EXIT,
 	MENU_QUIT,
 	MENU_NUM
 };
 
+void net_quit();
+void writedisk(int x, int y, int z, int s, char *data, int n, int format, char *etag, unsigned int modified);
+void write_quit();
+void pack_quit();
+void pack_sync();
+void pack_clean();
+int journal_checkpoint();
+void index_close();
+int index_sync(unsigned int gen);
+int index_others();
+int index_claim(int p);
+void index_release(int p);
+int index_owned(int p);
+int index_compactor();
+void disk_lock();
+int disk_trylock();
+void disk_unlock();
+void disk_wait(int ms);
+int warm_find(int x, int y, int z, int s);
+void warm_put(int x, int y, int z, int s, char *data, int n, int format);
+SDL_Surface *warm_get(int x, int y, int z, int s);
+void warm_keep(int x, int y, int z, int s, SDL_Surface *tile);
+
 /* quit */
 void quit()
 {
 	FILE *f;
 	
+	/* write the queued tiles, and stop the compaction of the disk cache */
+	write_quit();
+	pack_quit();
+	
 	/* do not save .dat files if there were not loaded! */
 	if (dat_loaded)
 	{
-		/* save disk cache */
-		if ((f = fopen("data/disk.dat", "wb")) != NULL)
-		{
-			fwrite(&disk_idx, sizeof(disk_idx), 1, f);
-			fwrite(disk, sizeof(struct _disk), config.cache_size, f);
-			fclose(f);
-		}
+		/* save disk cache with its tables, then delete the packs it no longer uses */
+		index_close();
 		
 		/* save configuration */
 		if ((f = fopen("data/config.dat", "wb")) != NULL)
@@ -306,6 +389,9 @@ void quit()
 		}
 	}
 	
+	/* stop background downloads */
+	net_quit();
+	
 	/* quit SDL and curl */
 	SDL_FreeSurface(prev);
 	SDL_FreeSurface(next);
@@ -321,8 +407,23 @@ void quit()
 	#endif
 }
 
+#include "source.c"
+#include "net.c"
+#include "journal.c"
+#include "dedup.c"
+#include "pack.c"
+#include "evict.c"
+#include "write.c"
 #include "tile.c"
+#include "warm.c"
+#include "index.c"
+#include "predict.c"
 #include "io.c"
+#include "bench.c"
+#include "seed.c"
+#include "replay.c"
+#include "verify.c"
+#include "mbtiles.c"
 
 /* displays a box centered at a specific position */
 void box(SDL_Surface *dst, int x, int y, int w, int h, int sh)
@@ -469,15 +570,32 @@ void info()
 	boxRGBA(screen, 0, 0, WIDTH, 15, 0, 0, 0, 200);
 	sprintf(temp, "Lat: %10.6f | Lon: %10.6f | Zoom: %3.1d%% | Type: %s", lat, lon, 100*(16-z)/20, _view[s]);
 	print(screen, 5, 0, temp);
+	
+	/* network statistics */
+	hlineRGBA(screen, 0, WIDTH, HEIGHT-33, 255, 255, 255, 255);
+	boxRGBA(screen, 0, HEIGHT-32, WIDTH, HEIGHT, 0, 0, 0, 200);
+	sprintf(temp, "Conn: %d new, %d reused | Shared: %d | Preempted: %d | Too big: %d | Failed: %d",
+		net_stats.opened, net_stats.reused, net_stats.coalesced, net_stats.preempted, net_stats.oversize, net_stats.failed);
+	print(screen, 5, HEIGHT-32, temp);
+	sprintf(temp, "Prediction: %d%% hits, %d KB | Disk: %d%% hits, %d evicted, %.2fx dedup",
+		predict_stats.predicted ? 100 * predict_stats.hits / predict_stats.predicted : 0,
+		net_stats.bytes[PRIO_PREDICT] / 1024,
+		disk_stats.hits + disk_stats.misses ? 100 * disk_stats.hits / (disk_stats.hits + disk_stats.misses) : 0,
+		disk_stats.evicted, dedup_blobs ? (float) dedup_refs / dedup_blobs : 1.0);
+	print(screen, 5, HEIGHT-16, temp);
 }
 
 /* updates the display */
 void display(int fx)
 {
+	static int view_x, view_y, view_z = 99, view_s;
 	SDL_Surface *tile;
 	SDL_Rect r;
 	int i, j, ok;
 
+	/* the tiles found busy are tried again */
+	disk_busy = 0;
+	
 	/* fix the bounds
 	 * disable the special effect to avoid map jumps */
 	if (x < 1) { x = 1; fx = FX_NONE; }
@@ -488,43 +606,36 @@ void display(int fx)
 	/* save the old screen */
 	SDL_BlitSurface(next, NULL, prev, NULL);
 	
-	/* check if everything is in memory cache */
-	ok = 1;
-	for (j = y-1; j < y+1; j++)
-		for (i = x-1; i < x+1; i++)
-			if (!getmemory(i, j, z, s))
-				ok = 0;
-	
-	/* if not, display loading notice */
-	if (!ok)
+	/* new set of tiles, older downloads become stale */
+	if ((int) x != view_x || (int) y != view_y || z != view_z || s != view_s)
 	{
-		int x, y;
-		SDL_BlitSurface(prev, NULL, screen, NULL);
-		box(screen, WIDTH/2, HEIGHT/2, 200, 70, 200);
-		TTF_SizeText(font, "LOADING...", &x, &y);
-		print(screen, WIDTH/2 - x/2, HEIGHT/2 - 10 - y/2, "LOADING...");
-		TTF_SizeText(font, _view[s], &x, &y);
-		print(screen, WIDTH/2 - x/2, HEIGHT/2 + 10 - y/2, _view[s]);
-		SDL_Flip(screen);
-		
+		view_x = x;
+		view_y = y;
+		view_z = z;
+		view_s = s;
+		net_view();
 	}
 	
-	/* build the new screen */
+	/* build the new screen
+	 * missing tiles are downloaded in background and left black until then */
+	ok = 1;
 	for (j = y-1; j < y+1; j++)
 		for (i = x-1; i < x+1; i++)
 		{
 			/* special process for hybrid maps: compose 2 images */
 			r.x = WIDTH/2 + (i-x)*256;
 			r.y = HEIGHT/2 + (j-y)*256;
+			r.w = r.h = 256;
+			SDL_FillRect(next, &r, BLACK);
 			switch (s)
 			{
 				case GG_HYBRID:
 					tile = gettile(i, j, z, GG_SATELLITE);
-					SDL_BlitSurface(tile, NULL, next, &r);
+					if (tile) SDL_BlitSurface(tile, NULL, next, &r); else ok = 0;
 					break;
 				case YH_HYBRID:
 					tile = gettile(i, j, z, YH_SATELLITE);
-					SDL_BlitSurface(tile, NULL, next, &r);
+					if (tile) SDL_BlitSurface(tile, NULL, next, &r); else ok = 0;
 					break;
 			}
 			
@@ -532,15 +643,47 @@ void display(int fx)
 			r.x = WIDTH/2 + (i-x)*256;
 			r.y = HEIGHT/2 + (j-y)*256;
 			tile = gettile(i, j, z, s);
-			SDL_BlitSurface(tile, NULL, next, &r);
+			if (tile) SDL_BlitSurface(tile, NULL, next, &r); else ok = 0;
+			predict_hit(i, j, z, s);
 		}
 	
+	/* prepare the ring around the screen, then the next zoom levels */
+	for (j = y-2; j < y+2; j++)
+		for (i = x-2; i < x+2; i++)
+			if (j < (int) (y-1) || j >= y+1 || i < (int) (x-1) || i >= x+1)
+				prefetch(i, j, z, PRIO_RING);
+	if (z > -4)
+		for (j = 2*y-1; j < 2*y+1; j++)
+			for (i = 2*x-1; i < 2*x+1; i++)
+				prefetch(i, j, z-1, PRIO_ZOOM);
+	if (z < 16)
+		for (j = y/2-1; j < y/2+1; j++)
+			for (i = x/2-1; i < x/2+1; i++)
+				prefetch(i, j, z+1, PRIO_ZOOM);
+	
+	/* and the places we are heading to */
+	predict_prefetch();
+	
+	/* drop the downloads for the places we left */
+	net_cancel();
+	
 	/* nicer transition */
 	effect(fx);
 	
 	/* restore the good screen */
 	SDL_BlitSurface(next, NULL, screen, NULL);
 	
+	/* if something is missing, display loading notice */
+	if (!ok)
+	{
+		int x, y;
+		box(screen, WIDTH/2, HEIGHT/2, 200, 70, 200);
+		TTF_SizeText(font, "LOADING...", &x, &y);
+		print(screen, WIDTH/2 - x/2, HEIGHT/2 - 10 - y/2, "LOADING...");
+		TTF_SizeText(font, _view[s], &x, &y);
+		print(screen, WIDTH/2 - x/2, HEIGHT/2 + 10 - y/2, _view[s]);
+	}
+	
 	/* show informations */
 	if (config.show_info) info();
 	if (config.show_kml) kml_display(screen, x, y, z);
@@ -552,8 +695,8 @@ void display(int fx)
 void go()
 {
 	char request[1024], buffer[50], *address;
-	SDL_RWops *rw;
-	int ret, code, precision;
+	netbuf response = {NULL, 0, 0, 1024};
+	int ret = 0, code, precision;
 	float lat, lon;
 	char _zoom[9] = {
 		16,	// unknown
@@ -576,17 +719,16 @@ void go()
 	sprintf(request, "http://maps.google.com/maps/geo?output=csv&key=%s&q=%s", gkey, address);
 	free(address);
 	
-	rw = SDL_RWFromMem(response, BUFFER_SIZE);
-	
 	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0");
 	curl_easy_setopt(curl, CURLOPT_URL, request);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, rw);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
 	curl_easy_perform(curl);
 	
-	ret = sscanf(response, "%d,%d,%f,%f", &code, &precision, &lat, &lon);
+	if (response.ptr)
+		ret = sscanf(response.ptr, "%d,%d,%f,%f", &code, &precision, &lat, &lon);
 	
 	if (ret == 4 && code == 200)
 	{
@@ -595,7 +737,7 @@ void go()
 		latlon2xy(lat, lon, &x, &y, z);
 	}
 	
-	SDL_RWclose(rw);
+	free(response.ptr);
 }
 
 /* calculate directions */
@@ -646,7 +788,8 @@ void directions()
 
 void menu_update(int cache_size)
 {
-	char temp[50];
+	char temp[100];
+	long long used;
 
 	#ifdef GP2X
 	#define MENU_LEFT 80
@@ -683,7 +826,25 @@ void menu_update(int cache_size)
 	ENTRY(MENU_KEYBOARD, "Keyboard type: %s", config.danzeff ? "Danzeff" : "Arcade");
 	ENTRY(MENU_CACHEZOOM, "Cache zoom levels: %d", cache_zoom);
 	ENTRY(MENU_CHEAT, "Switch to sky/moon/mars: %s", config.cheat ? "Yes" : "No");
-	ENTRY(MENU_CACHESIZE, "Cache size: %d (~ %d MB)", cache_size, cache_size * 20 / 1000);
+	/* measured, not estimated from the number of tiles */
+	disk_lock();
+	used = pack_bytes;
+	disk_unlock();
+	ENTRY(MENU_CACHESIZE, "Cache size: %d (%d MB used, %d%% hits)", cache_size, (int) (used / 1048576),
+		disk_stats.hits + disk_stats.misses ? 100 * disk_stats.hits / (disk_stats.hits + disk_stats.misses) : 0);
+	ENTRY(MENU_DISKBUDGET, config.disk_budget ? "Disk budget: %d MB" : "Disk budget: none", config.disk_budget);
+	if (config.warm_budget)
+	{
+		ENTRY(MENU_WARMBUDGET, "Warm cache: %d MB (%d MB used, %d%% hits)", config.warm_budget, (int) (warm_bytes / 1048576),
+			warm_stats.hits + warm_stats.misses ? 100 * warm_stats.hits / (warm_stats.hits + warm_stats.misses) : 0);
+	}
+	else
+	{
+		ENTRY(MENU_WARMBUDGET, "Warm cache: none");
+	}
+	ENTRY(MENU_TRANSFERS, "Parallel downloads: %d", config.transfers);
+	ENTRY(MENU_LOOKAHEAD, "Prefetch ahead: %d s", config.lookahead);
+	ENTRY(MENU_DISKFORMAT, "Cache tiles as: %s", _disk_format[config.disk_format]);
 	ENTRY(MENU_EXIT, "Exit menu");
 	ENTRY(MENU_QUIT, "Quit PSP-Maps");
 	SDL_BlitSurface(next, NULL, screen, NULL);
@@ -811,21 +972,23 @@ void menu()
 										{
 											float ratio = 1.0 * ++done / total;
 											boxRGBA(next, WIDTH/2 - 180, HEIGHT/2, WIDTH/2 - 180 + 360.0 * ratio, HEIGHT/2 + 15, 255, 0, 0, 255);
-											/* special process for hybrid maps: get 2 images */
-											switch (s)
+											prefetch(i, j, z-k, PRIO_BULK);
+											/* keep a few downloads ahead of the transfers */
+											while (net_pending() > config.transfers * 2)
 											{
-												case GG_HYBRID:
-													gettile(i, j, z-k, GG_SATELLITE);
-													break;
-												case YH_HYBRID:
-													gettile(i, j, z-k, YH_SATELLITE);
-													break;
+												receivetiles();
+												SDL_Delay(10);
 											}
-											gettile(i, j, z-k, s);
 											SDL_BlitSurface(next, NULL, screen, NULL);
 											SDL_Flip(screen);
 										}
 									}
+									/* wait for the last downloads */
+									while (net_pending())
+									{
+										receivetiles();
+										SDL_Delay(10);
+									}
 									break;
 								/* cheat */
 								case MENU_CHEAT:
@@ -838,25 +1001,32 @@ void menu()
 									if (config.cache_size != cache_size)
 									{
 										int old;
-										old = config.cache_size;
-										config.cache_size = cache_size;
-										/* remove data on disk if needed */
+										/* the tiles of the removed entries are dropped from the packs */
 										box(next, WIDTH/2, HEIGHT/2, 400, 70, 200);
 										print(next, 50, HEIGHT/2 - 30, "Cleaning cache...");
-										for (i = config.cache_size; i < disk_idx; i++)
+										SDL_BlitSurface(next, NULL, screen, NULL);
+										SDL_Flip(screen);
+										disk_lock();
+										/* the other processes use the entries as they are */
+										if (index_others())
+											cache_size = config.cache_size;
+										else
 										{
-											char name[50];
-											float ratio = 1.0 * (i - config.cache_size) / (disk_idx - config.cache_size);
-											boxRGBA(next, WIDTH/2 - 180, HEIGHT/2, WIDTH/2 - 180 + 360.0 * ratio, HEIGHT/2 + 15, 255, 0, 0, 255);
-											diskname(name, i);
-											unlink(name);
-											SDL_BlitSurface(next, NULL, screen, NULL);
-											SDL_Flip(screen);
+											old = config.cache_size;
+											config.cache_size = cache_size;
+											for (i = config.cache_size; i < old; i++)
+												if (disk[i].fetched)
+													pack_drop(i);
+											index_resize(old);
+											cache_size = config.cache_size;
+											diskindex_build();
+											diskqueue_build();
+											pack_count();
+											diskbudget(-1);
+											/* the journal is for the previous entries */
+											journal_checkpoint();
 										}
-										disk = realloc(disk, sizeof(struct _disk) * config.cache_size);
-										/* clear newly allocated memory if needed */
-										if (config.cache_size > old)
-											bzero(&disk[old], sizeof(struct _disk) * (config.cache_size - old));
+										disk_unlock();
 									}
 									break;
 								/* exit menu */
@@ -923,6 +1093,33 @@ void menu()
 									if (cache_size == 0) cache_size = MAX_CACHESIZE;
 									if (cache_size < 100) cache_size = 0;
 									break;
+								/* bytes of the disk cache, applied as the next tiles are saved */
+								case MENU_DISKBUDGET:
+									config.disk_budget /= 2;
+									if (config.disk_budget == 0) config.disk_budget = MAX_DISKBUDGET;
+									if (config.disk_budget < 8) config.disk_budget = 0;
+									break;
+								/* tiles kept encoded in memory, the warm tier starts again empty */
+								case MENU_WARMBUDGET:
+									config.warm_budget /= 2;
+									if (config.warm_budget == 0) config.warm_budget = MAX_WARMBUDGET;
+									warm_init();
+									break;
+								/* parallel downloads */
+								case MENU_TRANSFERS:
+									config.transfers--;
+									if (config.transfers < 1) config.transfers = MAX_TRANSFERS;
+									break;
+								/* predictive prefetch */
+								case MENU_LOOKAHEAD:
+									config.lookahead--;
+									if (config.lookahead < 0) config.lookahead = MAX_LOOKAHEAD;
+									break;
+								/* decoded tiles on disk */
+								case MENU_DISKFORMAT:
+									config.disk_format--;
+									if (config.disk_format < 0) config.disk_format = DISK_FORMATS - 1;
+									break;
 							}
 							menu_update(cache_size);
 							break;
@@ -979,6 +1176,34 @@ void menu()
 									if (cache_size == 0) cache_size = 100;
 									if (cache_size > MAX_CACHESIZE) cache_size = 0;
 									break;
+								/* bytes of the disk cache */
+								case MENU_DISKBUDGET:
+									config.disk_budget *= 2;
+									if (config.disk_budget == 0) config.disk_budget = 8;
+									if (config.disk_budget > MAX_DISKBUDGET) config.disk_budget = 0;
+									break;
+								/* tiles kept encoded in memory */
+								case MENU_WARMBUDGET:
+									config.warm_budget *= 2;
+									if (config.warm_budget == 0) config.warm_budget = 1;
+									if (config.warm_budget > MAX_WARMBUDGET) config.warm_budget = 0;
+									warm_init();
+									break;
+								/* parallel downloads */
+								case MENU_TRANSFERS:
+									config.transfers++;
+									if (config.transfers > MAX_TRANSFERS) config.transfers = 1;
+									break;
+								/* predictive prefetch */
+								case MENU_LOOKAHEAD:
+									config.lookahead++;
+									if (config.lookahead > MAX_LOOKAHEAD) config.lookahead = 0;
+									break;
+								/* decoded tiles on disk */
+								case MENU_DISKFORMAT:
+									config.disk_format++;
+									if (config.disk_format >= DISK_FORMATS) config.disk_format = 0;
+									break;
 							}
 							menu_update(cache_size);
 							break;
@@ -1005,12 +1230,13 @@ void menu()
 }
 
 /* init */
-void init()
+/* load the configuration and the caches, and start the downloads
+ * this is all the bench and the tools need, without the display */
+void init_data()
 {
-	int flags;
 	FILE *f;
-	int i;
-	char buffer[1024];
+	int i, exists;
+	char buffer[1024], *line;
 	
 	/* clear memory cache */
 	bzero(memory, sizeof(memory));
@@ -1023,6 +1249,11 @@ void init()
 	config.danzeff = 1;
 	config.cheat = 0;
 	config.follow_gps = 1;
+	config.transfers = NET_TRANSFERS;
+	config.lookahead = PREDICT_LOOKAHEAD;
+	config.disk_format = PACK_IMAGE;
+	config.disk_budget = DISK_BUDGET;
+	config.warm_budget = WARM_BUDGET;
 	
 	/* load configuration if available */
 	if ((f = fopen("data/config.dat", "rb")) != NULL)
@@ -1030,24 +1261,63 @@ void init()
 		fread(&config, sizeof(config), 1, f);
 		fclose(f);
 	}
+	if (config.transfers < 1 || config.transfers > MAX_TRANSFERS)
+		config.transfers = NET_TRANSFERS;
+	if (config.lookahead < 0 || config.lookahead > MAX_LOOKAHEAD)
+		config.lookahead = PREDICT_LOOKAHEAD;
+	if (config.disk_format < 0 || config.disk_format >= DISK_FORMATS)
+		config.disk_format = PACK_IMAGE;
+	if (config.disk_budget < 0 || config.disk_budget > MAX_DISKBUDGET)
+		config.disk_budget = DISK_BUDGET;
+	if (config.warm_budget < 0 || config.warm_budget > MAX_WARMBUDGET)
+		config.warm_budget = WARM_BUDGET;
+	warm_init();
 	
 	/* switch to sky if needed */
 	if (config.cheat) s = DEFAULT_CHEAT_MAP;
 	
-	/* allocate disk cache */
-	disk = malloc(sizeof(struct _disk) * config.cache_size);
+	/* map disk cache, nothing to load if pspmaps quit properly */
+	index_ready = index_open(&exists);
 	
-	/* load disk cache if available */
-	bzero(disk, sizeof(struct _disk) * config.cache_size);
-	if ((f = fopen("data/disk.dat", "rb")) != NULL)
+	/* or load the disk cache of a previous version: consider the tiles as just fetched */
+	if (!exists && (f = fopen("data/disk.dat", "rb")) != NULL)
 	{
-		fread(&disk_idx, sizeof(disk_idx), 1, f);
-		fread(disk, sizeof(struct _disk), config.cache_size, f);
+		struct _disk_v0 old;
+		int next;
+		/* the next entry to replace, then the entries */
+		fread(&next, sizeof(next), 1, f);
+		for (i = 0; i < config.cache_size && fread(&old, sizeof(old), 1, f) == 1; i++)
+		{
+			disk[i].x = old.x;
+			disk[i].y = old.y;
+			disk[i].z = old.z;
+			disk[i].s = old.s;
+			disk[i].fetched = disk[i].used = time(NULL);
+			disk[i].pack = PACK_LEGACY;
+		}
 		fclose(f);
 	}
+	/* the changes since the index was saved, if pspmaps did not quit properly */
+	journal_replay();
+	if (journal_changes && index_alone)
+		index_ready = 0;
+	if (!index_ready)
+	{
+		diskindex_build();
+		diskqueue_build();
+	}
 	
-	/* create disk cache directory if needed */
+	/* create disk cache directory if needed, and find its packs */
 	mkdir("cache", 0755);
+	pack_init();
+	journal_start();
+	/* the index replaces disk.dat once it is saved */
+	if (!exists && journal_checkpoint())
+		unlink("data/disk.dat");
+	/* the other processes can use the cache from now on */
+	index_unlock();
+	pack_start();
+	write_init();
 	
 	/* create kml directory if needed */
 	mkdir("kml", 0755);
@@ -1064,35 +1334,46 @@ void init()
 	dat_loaded = 1;
 	
 	/* setup curl */
+	curl_global_init(CURL_GLOBAL_ALL);
 	curl = curl_easy_init();
-	
-	/* setup SDL */
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_JOYSTICK | SDL_INIT_AUDIO) == -1)
-		quit();
-	joystick = SDL_JoystickOpen(0);
-	SDL_JoystickEventState(SDL_ENABLE);
-	if (TTF_Init() == -1)
-		quit();
-	if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) < 0)
-		quit();
+	net_init();
 	
 	/* load urls for services */
-	if ((f = fopen("urls.txt", "r")) == NULL)
+	if ((f = fopen(urls_file, "r")) == NULL)
 	{
 		DEBUG("cannot open urls file!\n");
 		quit();
 	}
 	for (i = 0; i < CHEAT_VIEWS; i++) if (i != NORMAL_VIEWS)
 	{
-		if (fscanf(f, "%s", buffer) != 1)
+		/* skip comments and empty lines */
+		while ((line = fgets(buffer, sizeof(buffer), f)) != NULL && (buffer[0] == '#' || strspn(buffer, " \t\r\n") == strlen(buffer)));
+		if (line == NULL || !source_load(i, buffer))
 		{
 			DEBUG("cannot read url for %s\n", _view[i]);
 			quit();
 		}
-		_url[i] = malloc(strlen(buffer) + 1);
-		strcpy(_url[i], buffer);
 	}
 	fclose(f);
+	net_limits();
+}
+
+void init()
+{
+	int flags;
+	
+	/* setup SDL, its clock first: the providers are timed from init_data() on */
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_JOYSTICK | SDL_INIT_AUDIO | SDL_INIT_TIMER) == -1)
+		quit();
+	
+	init_data();
+	
+	joystick = SDL_JoystickOpen(0);
+	SDL_JoystickEventState(SDL_ENABLE);
+	if (TTF_Init() == -1)
+		quit();
+	if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) < 0)
+		quit();
 	
 	#include "icon.xpm"
 	SDL_WM_SetIcon(IMG_ReadXPMFromArray(icon_xpm), NULL);
@@ -1283,7 +1564,11 @@ void loop()
 		x += dx;
 		y += dy;
 		
-		if (dx || dy) display(FX_NONE);
+		/* follow the moves for the predictive prefetch */
+		predict_update();
+		
+		/* refresh when downloads have arrived, or when the disk cache was busy */
+		if (receivetiles() || dx || dy || disk_busy) display(FX_NONE);
 		
 		SDL_Delay(50);
 	}
@@ -1312,6 +1597,121 @@ int gpsLoad()
 
 int main(int argc, char *argv[])
 {
+	int i, n = 0, v, seeding = 0, bbox = 0, index = 0, dedup = 0, formats = 0, threads = 0;
+	char *trace = NULL, *mbtiles = NULL, import = 0;
+	
+	/* command line options, for the PC version */
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--urls") == 0 && i+1 < argc)
+			urls_file = argv[++i];
+		else if (strcmp(argv[i], "--view") == 0 && i+1 < argc && seed_area.views_num < CHEAT_VIEWS)
+		{
+			v = atoi(argv[++i]);
+			if (v >= 0 && v < CHEAT_VIEWS && v != NORMAL_VIEWS)
+				seed_area.views[seed_area.views_num++] = v;
+		}
+		else if (strcmp(argv[i], "--zoom") == 0 && i+1 < argc)
+		{
+			if (sscanf(argv[++i], "%d-%d", &seed_area.zmin, &seed_area.zmax) < 2)
+				seed_area.zmax = seed_area.zmin;
+		}
+		else if (strcmp(argv[i], "--bench") == 0)
+			n = i+1 < argc && atoi(argv[i+1]) > 0 ? atoi(argv[++i]) : BENCH_TILES;
+		else if (strcmp(argv[i], "--bench-index") == 0)
+			index = 1;
+		else if (strcmp(argv[i], "--bench-dedup") == 0)
+			dedup = 1;
+		else if (strcmp(argv[i], "--bench-disk") == 0)
+			formats = i+1 < argc && atoi(argv[i+1]) > 0 ? atoi(argv[++i]) : BENCH_DISK_TILES;
+		else if (strcmp(argv[i], "--verify") == 0)
+		{
+			threads = i+1 < argc && atoi(argv[i+1]) > 0 ? atoi(argv[++i]) : VERIFY_THREADS;
+			pack_keep = 1;
+		}
+		else if ((strcmp(argv[i], "--import") == 0 || strcmp(argv[i], "--export") == 0) && i+1 < argc)
+		{
+			import = argv[i][2] == 'i';
+			mbtiles = argv[++i];
+		}
+		else if (strcmp(argv[i], "--seed") == 0)
+			seeding = 1;
+		else if (strcmp(argv[i], "--bbox") == 0 && i+1 < argc)
+			bbox = sscanf(argv[++i], "%f,%f,%f,%f", &seed_area.lat1, &seed_area.lon1, &seed_area.lat2, &seed_area.lon2) == 4;
+		else if (strcmp(argv[i], "--route") == 0 && i+1 < argc)
+			seed_area.route = argv[++i];
+		else if (strcmp(argv[i], "--radius") == 0 && i+1 < argc)
+			seed_area.radius = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+			disk_trace = fopen(argv[++i], "a");
+		else if (strcmp(argv[i], "--replay") == 0 && i+1 < argc)
+		{
+			trace = argv[++i];
+			n = i+1 < argc && atoi(argv[i+1]) > 0 ? atoi(argv[++i]) : 0;
+		}
+		else
+			break;
+	}
+	if (i < argc || (seeding && !bbox && seed_area.route == NULL))
+	{
+		printf("usage: %s [--urls file] [--view n]... [--zoom n[-n]]\n", argv[0]);
+		printf("          [--bench [tiles]] [--bench-index] [--bench-dedup] [--bench-disk [tiles]]\n");
+		printf("          [--seed --bbox lat,lon,lat,lon | --route file.kml [--radius tiles]]\n");
+		printf("          [--trace file] [--replay file [tiles]] [--verify [threads]]\n");
+		printf("          [--import file.mbtiles | --export file.mbtiles] [--view n]\n");
+		return 1;
+	}
+	if (seed_area.zmin < 1 || seed_area.zmin > 21) seed_area.zmin = 1;
+	if (seed_area.zmax < seed_area.zmin || seed_area.zmax > 21) seed_area.zmax = seed_area.zmin;
+	if (seed_area.radius < 0) seed_area.radius = SEED_RADIUS;
+	
+	/* benchmark of the downloads, seeding, check or copy of the cache, without display */
+	if (n || seeding || index || dedup || formats || trace || threads || mbtiles)
+	{
+		if (dedup && !bench_scratch())
+			return 1;
+		/* nothing to display: wait for the disk rather than drop tiles */
+		write_wait = 1;
+		SDL_Init(SDL_INIT_TIMER);
+		init_data();
+		na = IMG_Load("data/na.png");
+		if (seeding)
+			seed();
+		else if (threads)
+			verify(threads);
+		else if (mbtiles && import)
+			mbtiles_import(mbtiles, seed_area.views_num ? seed_area.views[0] : DEFAULT_MAP);
+		else if (mbtiles)
+			mbtiles_export(mbtiles, seed_area.views_num ? seed_area.views[0] : DEFAULT_MAP);
+		else if (index)
+		{
+			bench_index();
+			dat_loaded = 0;
+		}
+		else if (dedup)
+		{
+			bench_dedup();
+			bench_unscratch();
+		}
+		else if (formats)
+		{
+			bench_disk(formats);
+			dat_loaded = 0;
+		}
+		else if (trace)
+		{
+			replay(trace, n ? n : config.cache_size);
+			dat_loaded = 0;
+		}
+		else
+		{
+			bench(n, seed_area.views_num ? seed_area.views[0] : DEFAULT_MAP, 17 - seed_area.zmin);
+			/* keep the configuration and the caches as they were */
+			dat_loaded = 0;
+		}
+		quit();
+	}
+	
 	#ifdef _PSP_FW_VERSION
 	pspDebugScreenInit();
 	motion_loaded = motionLoad() >= 0;
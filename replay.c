@@ -0,0 +1,280 @@
+/* replay of a trace of the disk cache (pspmaps --trace) with several eviction policies
+ * to compare their hit rates on a real usage, for a cache of the same size
+ *   fifo   the ring of the previous versions
+ *   lru    least recently used
+ *   slru   segmented LRU, cold and hot queues as the disk cache does (evict.c)
+ *   arc    adaptive replacement cache, with the ghosts of the evicted tiles */
+
+#define REPLAY_POLICIES 4
+
+enum
+{
+	SIM_T1,
+	SIM_T2,
+	SIM_B1,
+	SIM_B2,
+	SIM_NONE
+};
+
+/* an access of the trace */
+typedef struct
+{
+	unsigned long long key;
+	char get;
+} traced;
+
+/* a tile known by the simulated cache, in one of the lists */
+typedef struct
+{
+	unsigned long long key;
+	int prev, next;
+	char list;
+} simentry;
+
+simentry *sim;
+int *sim_table, sim_mask, sim_free;
+struct
+{
+	int head, tail, size;
+} sim_list[SIM_NONE];
+
+/* returns the entry of the tile (key), or -1 */
+int sim_find(unsigned long long key)
+{
+	int h = tilehash(key) & sim_mask, i;
+
+	while ((i = sim_table[h]) != 0)
+	{
+		if (sim[i - 1].key == key)
+			return i - 1;
+		h = (h + 1) & sim_mask;
+	}
+	return -1;
+}
+
+void sim_unlink(int i)
+{
+	simentry *e = &sim[i];
+
+	if (e->prev >= 0) sim[e->prev].next = e->next;
+	else sim_list[(int) e->list].head = e->next;
+	if (e->next >= 0) sim[e->next].prev = e->prev;
+	else sim_list[(int) e->list].tail = e->prev;
+	sim_list[(int) e->list].size--;
+}
+
+/* put the entry (i) at the head (most recent) of the list (l) */
+void sim_push(int i, int l)
+{
+	simentry *e = &sim[i];
+
+	e->list = l;
+	e->prev = -1;
+	e->next = sim_list[l].head;
+	if (e->next >= 0) sim[e->next].prev = i;
+	else sim_list[l].tail = i;
+	sim_list[l].head = i;
+	sim_list[l].size++;
+}
+
+void sim_move(int i, int l)
+{
+	sim_unlink(i);
+	sim_push(i, l);
+}
+
+/* forget the entry (i), with backward-shift deletion as in the disk cache index */
+void sim_remove(int i)
+{
+	int h = tilehash(sim[i].key) & sim_mask, j, k;
+
+	sim_unlink(i);
+	while (sim_table[h] != i + 1)
+		h = (h + 1) & sim_mask;
+	for (j = (h + 1) & sim_mask; sim_table[j]; j = (j + 1) & sim_mask)
+	{
+		k = tilehash(sim[sim_table[j] - 1].key) & sim_mask;
+		if (j > h ? (k <= h || k > j) : (k <= h && k > j))
+		{
+			sim_table[h] = sim_table[j];
+			h = j;
+		}
+	}
+	sim_table[h] = 0;
+	sim[i].next = sim_free;
+	sim_free = i;
+}
+
+/* add the tile (key) to the head of the list (l) */
+int sim_add(unsigned long long key, int l)
+{
+	int h = tilehash(key) & sim_mask, i = sim_free;
+
+	sim_free = sim[i].next;
+	sim[i].key = key;
+	while (sim_table[h])
+		h = (h + 1) & sim_mask;
+	sim_table[h] = i + 1;
+	sim_push(i, l);
+	return i;
+}
+
+/* the least recent entry of the list (l) */
+#define SIM_LRU(l) sim_list[l].tail
+
+/* ARC: make room in T1 + T2 for a tile */
+void sim_replace(int in_b2, int p)
+{
+	if (sim_list[SIM_T1].size && (sim_list[SIM_T1].size > p || (in_b2 && sim_list[SIM_T1].size == p)))
+		sim_move(SIM_LRU(SIM_T1), SIM_B1);
+	else if (sim_list[SIM_T2].size)
+		sim_move(SIM_LRU(SIM_T2), SIM_B2);
+}
+
+/* simulate the cache of (c) tiles with (policy) on the trace, returns the hits */
+int sim_run(traced *trace, int n, int c, int policy)
+{
+	int i, k, e, hits = 0, p = 0, resident;
+
+	/* ARC remembers as many evicted tiles as it holds */
+	for (k = 16; k < c * 4; k *= 2);
+	sim = malloc(sizeof(simentry) * (c * 2 + 1));
+	sim_table = calloc(k, sizeof(int));
+	sim_mask = k - 1;
+	for (i = 0; i < c * 2 + 1; i++)
+		sim[i].next = i + 1;
+	sim_free = 0;
+	for (i = 0; i < SIM_NONE; i++)
+	{
+		sim_list[i].head = sim_list[i].tail = -1;
+		sim_list[i].size = 0;
+	}
+
+	for (k = 0; k < n; k++)
+	{
+		e = sim_find(trace[k].key);
+		resident = e >= 0 && (sim[e].list == SIM_T1 || sim[e].list == SIM_T2);
+		if (resident && trace[k].get)
+			hits++;
+		/* a tile downloaded ahead is only added, it does not count as a use */
+		if (resident && !trace[k].get)
+			continue;
+
+		switch (policy)
+		{
+			/* fifo: T1 only */
+			case 0:
+				if (resident) break;
+				if (sim_list[SIM_T1].size >= c)
+					sim_remove(SIM_LRU(SIM_T1));
+				sim_add(trace[k].key, SIM_T1);
+				break;
+			/* lru: T1 only */
+			case 1:
+				if (resident)
+					sim_move(e, SIM_T1);
+				else
+				{
+					if (sim_list[SIM_T1].size >= c)
+						sim_remove(SIM_LRU(SIM_T1));
+					sim_add(trace[k].key, SIM_T1);
+				}
+				break;
+			/* slru: T1 cold, T2 hot */
+			case 2:
+				if (resident)
+					sim_move(e, SIM_T2);
+				else
+				{
+					if (sim_list[SIM_T1].size + sim_list[SIM_T2].size >= c)
+						sim_remove(sim_list[SIM_T1].size ? SIM_LRU(SIM_T1) : SIM_LRU(SIM_T2));
+					sim_add(trace[k].key, SIM_T1);
+				}
+				if (sim_list[SIM_T2].size > c * DISK_HOT_SHARE / 100)
+					sim_move(SIM_LRU(SIM_T2), SIM_T1);
+				break;
+			/* arc: T1 seen once, T2 seen again, B1 and B2 their ghosts */
+			case 3:
+				if (resident)
+					sim_move(e, SIM_T2);
+				else if (e >= 0 && sim[e].list == SIM_B1)
+				{
+					p += sim_list[SIM_B2].size > sim_list[SIM_B1].size ? sim_list[SIM_B2].size / sim_list[SIM_B1].size : 1;
+					if (p > c) p = c;
+					sim_replace(0, p);
+					sim_move(e, SIM_T2);
+				}
+				else if (e >= 0)
+				{
+					p -= sim_list[SIM_B1].size > sim_list[SIM_B2].size ? sim_list[SIM_B1].size / sim_list[SIM_B2].size : 1;
+					if (p < 0) p = 0;
+					sim_replace(1, p);
+					sim_move(e, SIM_T2);
+				}
+				else
+				{
+					if (sim_list[SIM_T1].size + sim_list[SIM_B1].size >= c)
+					{
+						if (sim_list[SIM_T1].size < c)
+						{
+							sim_remove(SIM_LRU(SIM_B1));
+							sim_replace(0, p);
+						}
+						else
+							sim_remove(SIM_LRU(SIM_T1));
+					}
+					else if (sim_list[SIM_T1].size + sim_list[SIM_T2].size + sim_list[SIM_B1].size + sim_list[SIM_B2].size >= c)
+					{
+						if (sim_list[SIM_T1].size + sim_list[SIM_T2].size + sim_list[SIM_B1].size + sim_list[SIM_B2].size >= 2 * c)
+							sim_remove(SIM_LRU(SIM_B2));
+						sim_replace(0, p);
+					}
+					sim_add(trace[k].key, SIM_T1);
+				}
+				break;
+		}
+	}
+
+	free(sim);
+	free(sim_table);
+	return hits;
+}
+
+/* replay the trace (file) with a cache of (c) tiles */
+void replay(char *file, int c)
+{
+	char *names[REPLAY_POLICIES] = {"fifo", "lru", "slru", "arc"};
+	traced *trace = NULL;
+	FILE *f;
+	char op;
+	int n = 0, size = 0, gets = 0, x, y, z, s, i, t, hits;
+
+	if ((f = fopen(file, "r")) == NULL)
+	{
+		printf("replay: cannot open %s\n", file);
+		return;
+	}
+	while (fscanf(f, " %c %d %d %d %d", &op, &x, &y, &z, &s) == 5)
+	{
+		if (n == size)
+		{
+			size = size ? size * 2 : 4096;
+			trace = realloc(trace, sizeof(traced) * size);
+		}
+		trace[n].key = tilekey(x, y, z, s);
+		trace[n].get = op == 'g';
+		gets += trace[n].get;
+		n++;
+	}
+	fclose(f);
+	if (c < 1) c = 1;
+
+	printf("replay: %d accesses, %d by the display, cache of %d tiles\n", n, gets, c);
+	for (i = 0; i < REPLAY_POLICIES; i++)
+	{
+		t = SDL_GetTicks();
+		hits = sim_run(trace, n, c, i);
+		printf("replay: %-4s %6.2f%% hits (%d), %d ms\n", names[i], gets ? 100.0 * hits / gets : 0, hits, SDL_GetTicks() - t);
+	}
+	free(trace);
+}
@@ -0,0 +1,257 @@
+/* headless seeding of the disk cache, for offline use
+ * downloads all the tiles of an area (bounding box, or along a KML route)
+ * for a range of zoom levels and views, without display nor decoding */
+
+#define SEED_RADIUS 1
+#define SEED_REPORT 1000
+
+/* what to seed, from the command line */
+struct
+{
+	float lat1, lon1, lat2, lon2;
+	char *route;
+	int radius, zmin, zmax;
+	int views[CHEAT_VIEWS], views_num;
+} seed_area = {0, 0, 0, 0, NULL, SEED_RADIUS, 10, 12};
+
+/* progress of the seeding */
+struct
+{
+	int total, queued, skipped, saved, failed;
+	long long bytes;
+	int t0, report;
+} seed_stats;
+
+/* tiles of the route, without duplicates */
+unsigned long long *seed_keys = NULL;
+int seed_keys_num = 0, seed_keys_size = 0;
+
+/* returns 1 if the data looks like an image: PNG, JPEG or GIF */
+int seed_image(char *data, int n)
+{
+	if (n > 4 && memcmp(data, "\x89PNG", 4) == 0) return 1;
+	if (n > 3 && memcmp(data, "\xff\xd8\xff", 3) == 0) return 1;
+	if (n > 4 && memcmp(data, "GIF8", 4) == 0) return 1;
+	return 0;
+}
+
+/* save the finished downloads straight to the disk cache */
+void seed_receive()
+{
+	job *j;
+
+	while ((j = net_done()) != NULL)
+	{
+		if (j->ok && j->code == 304)
+		{
+			touchdisk(j->x, j->y, j->z, j->s);
+			seed_stats.saved++;
+		}
+		else if (j->ok && j->code == 200 && seed_image(j->buf.ptr, j->buf.size))
+		{
+			savedisk(j->x, j->y, j->z, j->s, j->buf.ptr, j->buf.size, PACK_IMAGE, j->etag, j->modified);
+			disktrace('p', j->x, j->y, j->z, j->s);
+			seed_stats.saved++;
+			seed_stats.bytes += j->buf.size;
+		}
+		else
+		{
+			net_fail(j->x, j->y, j->z, j->s);
+			seed_stats.failed++;
+		}
+		net_free(j);
+	}
+}
+
+/* print the progress, with the estimated time left */
+void seed_report(int last)
+{
+	int now = SDL_GetTicks(), done, eta;
+	float elapsed = (now - seed_stats.t0) / 1000.0, rate;
+
+	if (!last && now - seed_stats.report < SEED_REPORT) return;
+	seed_stats.report = now;
+
+	done = seed_stats.skipped + seed_stats.saved + seed_stats.failed;
+	rate = elapsed > 0 ? (seed_stats.saved + seed_stats.failed) / elapsed : 0;
+	eta = rate > 0 ? (seed_stats.total - done) / rate : 0;
+	printf("\rseed: %d/%d tiles, %d saved, %d cached, %d failed, %.1f tiles/s, %.1f KB/s, ETA %d:%02d:%02d ",
+		done, seed_stats.total, seed_stats.saved, seed_stats.skipped, seed_stats.failed,
+		rate, elapsed > 0 ? seed_stats.bytes / 1024 / elapsed : 0, eta / 3600, eta / 60 % 60, eta % 60);
+	if (last) printf("\n");
+	fflush(stdout);
+}
+
+/* queue the tile (x,y,z) of the view (v), keeping a few downloads ahead of the transfers */
+void seed_tile(int x, int y, int z, int v)
+{
+	if (cachetile(x, y, z, v, PRIO_BULK))
+		seed_stats.queued++;
+	else
+		seed_stats.skipped++;
+	while (net_pending() > config.transfers * 4)
+	{
+		seed_receive();
+		seed_report(0);
+		SDL_Delay(5);
+	}
+	seed_receive();
+}
+
+/* add a tile of the route, if it is not there yet */
+void seed_add(int x, int y, int z)
+{
+	unsigned long long key = tilekey(x, y, z, 0), *old;
+	int i, n;
+
+	if (x < 0 || y < 0 || x >= 1 << (17-z) || y >= 1 << (17-z)) return;
+
+	/* open addressing, kept at most half full */
+	if (seed_keys_num * 2 >= seed_keys_size)
+	{
+		old = seed_keys;
+		n = seed_keys_size;
+		seed_keys_size = n ? n * 2 : 1024;
+		seed_keys = malloc(sizeof(*seed_keys) * seed_keys_size);
+		memset(seed_keys, 0xff, sizeof(*seed_keys) * seed_keys_size);
+		seed_keys_num = 0;
+		for (i = 0; i < n; i++)
+			if (old[i] != ~0ULL)
+				seed_add(old[i] >> 40, old[i] >> 16 & 0xffffff, (signed char) (old[i] >> 8));
+		free(old);
+	}
+	for (i = tilehash(key) % seed_keys_size; seed_keys[i] != ~0ULL; i = (i + 1) % seed_keys_size)
+		if (seed_keys[i] == key)
+			return;
+	seed_keys[i] = key;
+	seed_keys_num++;
+}
+
+/* add the tiles around the line from (lat1,lon1) to (lat2,lon2) at zoom (z) */
+void seed_line(float lat1, float lon1, float lat2, float lon2, int z)
+{
+	float x1, y1, x2, y2, d, t;
+	int i, j, n;
+
+	latlon2xy(lat1, lon1, &x1, &y1, z);
+	latlon2xy(lat2, lon2, &x2, &y2, z);
+	d = fabs(x2 - x1) > fabs(y2 - y1) ? fabs(x2 - x1) : fabs(y2 - y1);
+	/* at least two steps per tile */
+	n = d * 2 + 1;
+	for (t = 0; t <= n; t++)
+		for (j = -seed_area.radius; j <= seed_area.radius; j++)
+			for (i = -seed_area.radius; i <= seed_area.radius; i++)
+				seed_add((int) (x1 + (x2 - x1) * t / n) + i, (int) (y1 + (y2 - y1) * t / n) + j, z);
+}
+
+/* collect the tiles of the route, for every zoom level */
+int seed_route()
+{
+	Placemark *place;
+	char *copy, *tmp;
+	float lat, lon, olat = 0, olon = 0;
+	int z, init;
+
+	kml_parse(seed_area.route);
+	if (places == NULL)
+	{
+		printf("seed: nothing to seed in %s\n", seed_area.route);
+		return 0;
+	}
+	for (z = 17 - seed_area.zmin; z >= 17 - seed_area.zmax; z--)
+		for (place = places; place; place = place->next)
+			switch (place->type)
+			{
+				case PLACEMARK_POINT:
+					seed_line(place->point->lat, place->point->lon, place->point->lat, place->point->lon, z);
+					break;
+				case PLACEMARK_LINE:
+					init = 0;
+					copy = strdup(place->line);
+					for (tmp = strtok(copy, " \n\t"); tmp; tmp = strtok(NULL, " \n\t"))
+						if (sscanf(tmp, "%f,%f", &lon, &lat) == 2)
+						{
+							seed_line(init ? olat : lat, init ? olon : lon, lat, lon, z);
+							olat = lat;
+							olon = lon;
+							init = 1;
+						}
+					free(copy);
+					break;
+			}
+	return 1;
+}
+
+/* seed the disk cache, as set by the command line */
+void seed()
+{
+	float x1, y1, x2, y2;
+	int i, j, k, v, z;
+
+	if (!config.cache_size)
+	{
+		printf("seed: the disk cache is disabled\n");
+		return;
+	}
+	if (!seed_area.views_num)
+		seed_area.views[seed_area.views_num++] = DEFAULT_MAP;
+	/* hybrid maps are drawn over the satellite view */
+	for (k = 0; k < seed_area.views_num; k++)
+	{
+		v = seed_area.views[k] == GG_HYBRID ? GG_SATELLITE : seed_area.views[k] == YH_HYBRID ? YH_SATELLITE : -1;
+		for (i = 0; v >= 0 && i < seed_area.views_num; i++)
+			if (seed_area.views[i] == v) v = -1;
+		if (v >= 0 && seed_area.views_num < CHEAT_VIEWS)
+			seed_area.views[seed_area.views_num++] = v;
+	}
+	bzero(&seed_stats, sizeof(seed_stats));
+
+	/* count the tiles first, for the progress */
+	if (seed_area.route != NULL)
+	{
+		if (!seed_route()) return;
+		seed_stats.total = seed_keys_num * seed_area.views_num;
+	}
+	else
+		for (z = 17 - seed_area.zmin; z >= 17 - seed_area.zmax; z--)
+		{
+			latlon2xy(seed_area.lat1, seed_area.lon1, &x1, &y1, z);
+			latlon2xy(seed_area.lat2, seed_area.lon2, &x2, &y2, z);
+			seed_stats.total += (abs((int) x2 - (int) x1) + 1) * (abs((int) y2 - (int) y1) + 1) * seed_area.views_num;
+		}
+	printf("seed: %d tiles, zoom %d to %d, %d views, %d transfers\n",
+		seed_stats.total, seed_area.zmin, seed_area.zmax, seed_area.views_num, config.transfers);
+	if (seed_stats.total > config.cache_size)
+		printf("seed: warning, the disk cache only holds %d tiles\n", config.cache_size);
+
+	seed_stats.t0 = SDL_GetTicks();
+	for (k = 0; k < seed_area.views_num; k++)
+	{
+		v = seed_area.views[k];
+		if (seed_area.route != NULL)
+		{
+			for (i = 0; i < seed_keys_size; i++)
+				if (seed_keys[i] != ~0ULL)
+					seed_tile(seed_keys[i] >> 40, seed_keys[i] >> 16 & 0xffffff, (signed char) (seed_keys[i] >> 8), v);
+			continue;
+		}
+		for (z = 17 - seed_area.zmin; z >= 17 - seed_area.zmax; z--)
+		{
+			latlon2xy(seed_area.lat1, seed_area.lon1, &x1, &y1, z);
+			latlon2xy(seed_area.lat2, seed_area.lon2, &x2, &y2, z);
+			for (j = y1 < y2 ? y1 : y2; j <= (int) (y1 < y2 ? y2 : y1); j++)
+				for (i = x1 < x2 ? x1 : x2; i <= (int) (x1 < x2 ? x2 : x1); i++)
+					seed_tile(i, j, z, v);
+		}
+	}
+
+	/* wait for the last downloads */
+	while (net_pending())
+	{
+		seed_receive();
+		seed_report(0);
+		SDL_Delay(5);
+	}
+	seed_report(1);
+	free(seed_keys);
+}
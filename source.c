@@ -0,0 +1,287 @@
+/* tile sources: the urls of urls.txt, compiled once at startup
+ *
+ * a source is an url with placeholders, followed by options:
+ *   http://tile.openstreetmap.org/{z}/{x}/{y}.png scheme=xyz zoom=0-18
+ * placeholders:
+ *   {x} {y}        tile, {y} counts from the bottom with scheme=tms
+ *   {-y}           tile, counting from the bottom
+ *   {z}            zoom, 0 for the whole world, also {17-z} or {z+1}
+ *   {s}            subdomain, from subdomains=a,b,c
+ *   {q}            Virtual Earth quadkey
+ *   {t}            Google "t" tile string (qrst)
+ * options:
+ *   scheme=xyz|tms|quadkey|google, subdomains=list, zoom=min-max,
+ *   size=pixels (scaled to 256), flip=n (count {-y} from 2^(z+n))
+ * the old printf urls of the previous versions are still accepted */
+
+#define MAX_SEGMENTS 32
+#define MAX_SUBDOMAINS 8
+#define MAX_SUBDOMAIN 16
+#define MAX_TEMPLATE 512
+#define TILE_SIZE 256
+
+/* parts of a compiled url */
+enum
+{
+	SEG_TEXT,
+	SEG_X,
+	SEG_Y,
+	SEG_Z,
+	SEG_SUBDOMAIN,
+	SEG_QUADKEY,
+	SEG_GOOGLE
+};
+
+typedef struct
+{
+	char type, flip;
+	/* text: offset and length in the url, zoom: a + b * z */
+	short a, b;
+} segment;
+
+typedef struct
+{
+	char *url;
+	segment segments[MAX_SEGMENTS];
+	int segments_num;
+	char *subdomains[MAX_SUBDOMAINS];
+	int subdomains_num;
+	int zmin, zmax, size, flip, tms;
+} source;
+source sources[CHEAT_VIEWS];
+
+/* placeholders of the old printf urls, in the order of their arguments */
+char *_legacy[CHEAT_VIEWS] = {
+	"{s} {x} {y} {17-z}",
+	"{s} {x} {y} {17-z}",
+	"{s} {x} {y} {17-z}",
+	"{s} {x} {y} {17-z}",
+	"{q}",
+	"{q}",
+	"{q}",
+	"{q}",
+	"{x} {-y} {18-z}",
+	"{x} {-y} {18-z}",
+	"{x} {-y} {18-z}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+	"",
+	"{z} {x} {-y}",
+	"{z} {x} {-y}",
+	"{z} {x} {-y}",
+	"{t}",
+	"{t}",
+	"{t}",
+	"{x} {y} {z}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+	"{z} {x} {y}",
+};
+
+/* servers of the old Google urls */
+char *_legacy_subdomains[] = {"0", "1", "2", "3"};
+
+/* convert the old printf url (url) of view (v) to placeholders in (out) */
+void source_legacy(char *url, int v, char *out)
+{
+	char *p = _legacy[v], *e;
+
+	while (*url)
+		if (url[0] == '%' && (url[1] == 'd' || url[1] == 's'))
+		{
+			url += 2;
+			if (!*p) continue;
+			e = strchr(p, ' ');
+			if (e == NULL) e = p + strlen(p);
+			memcpy(out, p, e - p);
+			out += e - p;
+			p = *e ? e + 1 : e;
+		}
+		else
+			*out++ = *url++;
+	*out = '\0';
+}
+
+/* compile the placeholder (p) of length (n), returns 0 if it is unknown */
+int source_placeholder(segment *g, char *p, int n)
+{
+	char name[20];
+	int a;
+
+	if (n >= sizeof(name)) return 0;
+	memcpy(name, p, n);
+	name[n] = '\0';
+	g->flip = 0;
+	g->a = 0;
+	g->b = 1;
+	if (strcmp(name, "x") == 0) g->type = SEG_X;
+	else if (strcmp(name, "y") == 0) g->type = SEG_Y;
+	else if (strcmp(name, "-y") == 0) { g->type = SEG_Y; g->flip = 1; }
+	else if (strcmp(name, "s") == 0) g->type = SEG_SUBDOMAIN;
+	else if (strcmp(name, "q") == 0) g->type = SEG_QUADKEY;
+	else if (strcmp(name, "t") == 0) g->type = SEG_GOOGLE;
+	else if (strcmp(name, "z") == 0) g->type = SEG_Z;
+	else if (sscanf(name, "%d-z", &a) == 1 && strchr(name, 'z')) { g->type = SEG_Z; g->a = a; g->b = -1; }
+	else if (sscanf(name, "z%d", &a) == 1) { g->type = SEG_Z; g->a = a; }
+	else return 0;
+	return 1;
+}
+
+/* load the source of view (v) from the line (line) of urls.txt, returns 0 on error */
+int source_load(int v, char *line)
+{
+	source *src = &sources[v];
+	segment *g;
+	char url[MAX_TEMPLATE], *option, *u, *e, *list;
+	int i;
+
+	option = strtok(line, " \t\r\n");
+	if (option == NULL || strlen(option) >= MAX_TEMPLATE / 2) return 0;
+
+	bzero(src, sizeof(source));
+	src->zmin = 0;
+	src->zmax = 21;
+	src->size = TILE_SIZE;
+	if (strchr(option, '%') != NULL && strchr(option, '{') == NULL)
+	{
+		source_legacy(option, v, url);
+		/* the old Google urls always used 4 servers */
+		if (strstr(_legacy[v], "{s}") != NULL)
+			for (i = 0; i < 4; i++)
+				src->subdomains[src->subdomains_num++] = _legacy_subdomains[i];
+		/* and Yahoo! counted from the middle of the world */
+		if (strstr(_legacy[v], "{18-z}") != NULL)
+			src->flip = -1;
+	}
+	else
+		strcpy(url, option);
+	src->url = _url[v] = strdup(url);
+
+	/* options */
+	while ((option = strtok(NULL, " \t\r\n")) != NULL)
+	{
+		if (strncmp(option, "subdomains=", 11) == 0)
+		{
+			src->subdomains_num = 0;
+			list = strdup(option + 11);
+			for (u = list; *u && src->subdomains_num < MAX_SUBDOMAINS; u = e)
+			{
+				if ((e = strchr(u, ',')) != NULL) *e++ = '\0';
+				else e = u + strlen(u);
+				if (strlen(u) <= MAX_SUBDOMAIN)
+					src->subdomains[src->subdomains_num++] = u;
+			}
+		}
+		else if (strcmp(option, "scheme=tms") == 0)
+			src->tms = 1;
+		else if (sscanf(option, "zoom=%d-%d", &src->zmin, &src->zmax) == 2);
+		else if (sscanf(option, "size=%d", &src->size) == 1);
+		else if (sscanf(option, "flip=%d", &src->flip) == 1);
+		else if (strncmp(option, "scheme=", 7) != 0)
+			DEBUG("unknown option for %s: %s\n", _view[v], option);
+	}
+
+	/* split the url in text and placeholders */
+	for (u = src->url; *u && src->segments_num < MAX_SEGMENTS; u = e)
+	{
+		g = &src->segments[src->segments_num++];
+		if (*u == '{' && (e = strchr(u, '}')) != NULL)
+		{
+			if (!source_placeholder(g, u + 1, e - u - 1))
+			{
+				DEBUG("unknown placeholder for %s: %s\n", _view[v], u);
+				return 0;
+			}
+			e++;
+		}
+		else
+		{
+			for (e = u + 1; *e && *e != '{'; e++);
+			g->type = SEG_TEXT;
+			g->a = u - src->url;
+			g->b = e - u;
+		}
+	}
+	if (*u) return 0;
+
+	/* with tms, {y} counts from the bottom too */
+	for (i = 0; i < src->segments_num; i++)
+		if (src->segments[i].type == SEG_Y && src->tms)
+			src->segments[i].flip = !src->segments[i].flip;
+	return 1;
+}
+
+/* returns 1 if the view (s) has tiles at zoom (z) */
+int source_has(int z, int s)
+{
+	return 17 - z >= sources[s].zmin && 17 - z <= sources[s].zmax;
+}
+
+/* writes the number (n) at (r), returns the end */
+char *source_int(char *r, int n)
+{
+	char b[12];
+	int i = 0;
+
+	if (n < 0)
+	{
+		*r++ = '-';
+		n = -n;
+	}
+	do b[i++] = '0' + n % 10; while ((n /= 10) > 0);
+	while (i > 0) *r++ = b[--i];
+	return r;
+}
+
+/* returns in (request) the url of the tile for location (x,y,z) with mode (s),
+ * or 0 if the view has no such tile
+ * the subdomain only depends on the tile, so that every server
+ * keeps reusing its own connections */
+int geturl(char *request, int x, int y, int z, int s)
+{
+	source *src = &sources[s];
+	segment *g;
+	char *r = request, *sub;
+	int zoom = 17 - z, i;
+
+	if (src->url == NULL || zoom < src->zmin || zoom > src->zmax) return 0;
+
+	for (g = src->segments; g < src->segments + src->segments_num; g++)
+		switch (g->type)
+		{
+			case SEG_TEXT:
+				memcpy(r, src->url + g->a, g->b);
+				r += g->b;
+				break;
+			case SEG_X:
+				r = source_int(r, x);
+				break;
+			case SEG_Y:
+				r = source_int(r, g->flip ? (1 << (zoom + src->flip)) - 1 - y : y);
+				break;
+			case SEG_Z:
+				r = source_int(r, g->a + g->b * zoom);
+				break;
+			case SEG_SUBDOMAIN:
+				if (!src->subdomains_num) break;
+				sub = src->subdomains[(x + y) % src->subdomains_num];
+				strcpy(r, sub);
+				r += strlen(sub);
+				break;
+			case SEG_QUADKEY:
+				for (i = zoom - 1; i >= 0; i--)
+					*r++ = '0' + (x >> i & 1) + 2 * (y >> i & 1);
+				break;
+			case SEG_GOOGLE:
+				*r++ = 't';
+				for (i = zoom - 1; i >= 0; i--)
+					*r++ = "qrts"[(x >> i & 1) + 2 * (y >> i & 1)];
+				break;
+		}
+	*r = '\0';
+	return 1;
+}
@@ -1,219 +1,408 @@
-/* returns in buffer "b" the name of the Google Maps tile for location (x,y,z) */
-char *GGtile(int x, int y, int z)
+/* save tile in memory cache, replacing the previous version if any */
+void savememory(int x, int y, int z, int s, SDL_Surface *tile)
 {
-	static char b[99];
-	int c = 18 - z;
-	b[c] = '\0';
-	while (z++ < 17)
-	{
-		c--;
-		if (x % 2)
-		{
-			if (y % 2)
-				b[c] = 's';
-			else
-				b[c] = 'r';
-		}
-		else
+	int i;
+	DEBUG("savememory(%d, %d, %d, %d)\n", x, y, z, s);
+	for (i = 0; i < MEMORY_CACHE_SIZE; i++)
+		if (memory[i].tile && memory[i].x == x && memory[i].y == y && memory[i].z == z && memory[i].s == s)
 		{
-			if (y % 2)
-				b[c] = 't';
-			else
-				b[c] = 'q';
+			SDL_FreeSurface(memory[i].tile);
+			memory[i].tile = tile;
+			return;
 		}
-		x/=2;
-		y/=2;
+	/* the oldest one goes to the warm tier */
+	if (memory[memory_idx].tile != NULL)
+		warm_keep(memory[memory_idx].x, memory[memory_idx].y, memory[memory_idx].z, memory[memory_idx].s, memory[memory_idx].tile);
+	SDL_FreeSurface(memory[memory_idx].tile);
+	memory[memory_idx].x = x;
+	memory[memory_idx].y = y;
+	memory[memory_idx].z = z;
+	memory[memory_idx].s = s;
+	memory[memory_idx].tile = tile;
+	memory_idx = (memory_idx + 1) % MEMORY_CACHE_SIZE;
+}
+
+/* index of the disk cache by tile: open addressing with linear probing
+ * a slot holds the entry + 1, or 0 if it is free
+ * the table is a power of 2, at least twice as big as the cache */
+int *disk_table = NULL;
+int disk_mask = 0;
+
+/* returns the first slot to try for the tile of the entry (i) */
+int diskslot(int i)
+{
+	return tilehash(tilekey(disk[i].x, disk[i].y, disk[i].z, disk[i].s)) & disk_mask;
+}
+
+/* return the disk cache entry for the tile, or -1 */
+int indisk(int x, int y, int z, int s)
+{
+	int h = tilehash(tilekey(x, y, z, s)) & disk_mask, i;
+
+	if (disk_table == NULL) return -1;
+	while ((i = disk_table[h]) != 0)
+	{
+		i--;
+		if (disk[i].x == x && disk[i].y == y && disk[i].z == z && disk[i].s == s)
+			return i;
+		h = (h + 1) & disk_mask;
 	}
-	b[0] = 't';
-	return b;
+	return -1;
 }
 
-/* returns in buffer "b" the name of the Virtual Earth tile for location (x,y,z) */
-char *VEtile(int x, int y, int z)
+/* add the entry (i) to the index */
+void diskindex_add(int i)
 {
-	static char b[99];
-	int c = 17 - z;
-	b[c] = '\0';
-	while (z++ < 17)
+	int h = diskslot(i);
+	while (disk_table[h])
+		h = (h + 1) & disk_mask;
+	disk_table[h] = i + 1;
+}
+
+/* remove the entry (i) from the index
+ * the next entries are moved back, so that no probe chain is broken */
+void diskindex_remove(int i)
+{
+	int h = diskslot(i), j, k;
+
+	while (disk_table[h] && disk_table[h] != i + 1)
+		h = (h + 1) & disk_mask;
+	if (!disk_table[h]) return;
+
+	for (j = (h + 1) & disk_mask; disk_table[j]; j = (j + 1) & disk_mask)
 	{
-		c--;
-		if (x % 2)
+		/* the entry can move to the hole if its first slot is not after the hole */
+		k = diskslot(disk_table[j] - 1);
+		if (j > h ? (k <= h || k > j) : (k <= h && k > j))
 		{
-			if (y % 2)
-				b[c] = '3';
-			else
-				b[c] = '1';
+			disk_table[h] = disk_table[j];
+			h = j;
 		}
-		else
+	}
+	disk_table[h] = 0;
+}
+
+/* build the index of the whole disk cache, after loading or resizing it */
+void diskindex_build()
+{
+	int i, size = 16;
+
+	while (size < config.cache_size * 2) size *= 2;
+	if (!INDEX_HOLDS(disk_table))
+		free(disk_table);
+	disk_table = calloc(size, sizeof(int));
+	disk_mask = size - 1;
+
+	/* entries never used have no fetch time */
+	for (i = 0; i < config.cache_size; i++)
+		if (disk[i].fetched && indisk(disk[i].x, disk[i].y, disk[i].z, disk[i].s) < 0)
+			diskindex_add(i);
+}
+
+/* point the entry (i) to a record with the same (n) bytes of (data) in (format), if there is one
+ * its (etag) is kept apart if the record has another one (see pack_tag())
+ * returns 0 if the tile must be written */
+int diskshare(int i, char *data, int n, int format, unsigned int hash, char *etag)
+{
+	record *r;
+	char *buf;
+	int h, length = strlen(etag) < 100 ? strlen(etag) : 0, other;
+	
+	for (h = tilehash(hash) & dedup_mask; dedup_table[h].refs; h = (h + 1) & dedup_mask)
+	{
+		if (dedup_table[h].hash != hash)
+			continue;
+		r = pack_record(dedup_table[h].pack, dedup_table[h].offset, dedup_table[h].length, &buf);
+		/* the same hash is not enough */
+		if (r != NULL && r->magic == PACK_MAGIC && r->size == n && r->format == format
+			&& memcmp((char *) (r + 1) + r->etag, data, n) == 0)
 		{
-			if (y % 2)
-				b[c] = '2';
-			else
-				b[c] = '0';
+			other = r->etag != length || memcmp(r + 1, etag, length) != 0;
+			disk[i].etag = r->etag;
+			free(buf);
+			if (other && !pack_tag(i, etag))
+				return 0;
+			disk[i].pack = dedup_table[h].pack;
+			disk[i].offset = dedup_table[h].offset;
+			disk[i].size = n;
+			disk[i].hash = hash;
+			dedup_share(&dedup_table[h]);
+			return 1;
 		}
-		x/=2;
-		y/=2;
+		free(buf);
 	}
-	return b;
+	return 0;
 }
 
-/* save tile in memory cache */
-void savememory(int x, int y, int z, int s, SDL_Surface *tile)
+/* remove the tile of the entry (i) from the disk cache, the pack lock must be held */
+void diskevict(int i)
 {
-	DEBUG("savememory(%d, %d, %d, %d)\n", x, y, z, s);
-	SDL_FreeSurface(memory[memory_idx].tile);
-	memory[memory_idx].x = x;
-	memory[memory_idx].y = y;
-	memory[memory_idx].z = z;
-	memory[memory_idx].s = s;
-	memory[memory_idx].tile = tile;
-	memory_idx = (memory_idx + 1) % MEMORY_CACHE_SIZE;
+	diskindex_remove(i);
+	pack_drop(i);
+	diskqueue_free(i);
+	disk[i].fetched = 0;
+	journal_write(i);
+	disk_stats.evicted++;
 }
 
-/* return the disk file name for cache entry
- * maximum of 1000 entries per folder to improve access speed */
-void diskname(char *buf, int n)
+/* evict the oldest tiles until the disk cache fits in its budgets, except the entry (keep)
+ * first the providers over their own budget, then the whole cache
+ * the pack lock must be held */
+void diskbudget(int keep)
 {
-	/* create folders if needed */
-	sprintf(buf, "cache/%.3d", n/1000);
-	mkdir(buf, 0755);
-	/* return the full file name */
-	sprintf(buf, "cache/%.3d/%.3d.dat", n/1000, n%1000);
+	long long budget = config.disk_budget * 1048576LL;
+	int p, i;
+
+	for (p = 0; p < providers_num; p++)
+		while (providers[p].disk && pack_used[p] > providers[p].disk && (i = diskqueue_victim(p, keep)) >= 0)
+			diskevict(i);
+	/* a shared record only goes with its last tile */
+	while (budget && pack_bytes > budget && (i = diskqueue_victim(-1, keep)) >= 0)
+		diskevict(i);
 }
 
-/* save tile in disk cache */
-void savedisk(int x, int y, int z, int s, SDL_RWops *rw, int n)
+/* write tile in disk cache, with its HTTP validators, for savedisk() (see write.c)
+ * (data) is the downloaded image, or pixels in (format)
+ * a tile already in cache keeps its entry, its new version is appended to the packs
+ * unless the same content is already there */
+void writedisk(int x, int y, int z, int s, char *data, int n, int format, char *etag, unsigned int modified)
 {
-	FILE *f;
-	char name[50];
-	char buffer[BUFFER_SIZE];
-	
-	if (!config.cache_size) return;
+	unsigned int hash = dedup_sum(data, n);
+	int i;
 	
-	DEBUG("savedisk(%d, %d, %d, %d)\n", x, y, z, s);
+	DEBUG("writedisk(%d, %d, %d, %d)\n", x, y, z, s);
 	
-	if (rw == NULL)
+	disk_lock();
+	if ((i = indisk(x, y, z, s)) < 0)
 	{
-		printf("warning: savedisk(NULL)!\n");
-		return;
+		/* a free entry, or evict a tile */
+		i = diskqueue_take();
+		if (disk[i].fetched)
+		{
+			diskindex_remove(i);
+			pack_drop(i);
+		}
+		disk[i].x = x;
+		disk[i].y = y;
+		disk[i].z = z;
+		disk[i].s = s;
+		diskindex_add(i);
+		diskqueue_add(i);
 	}
+	else
+		pack_drop(i);
 	
-	disk[disk_idx].x = x;
-	disk[disk_idx].y = y;
-	disk[disk_idx].z = z;
-	disk[disk_idx].s = s;
+	disk[i].fetched = time(NULL);
+	disk[i].modified = modified;
 	
-	SDL_RWseek(rw, 0, SEEK_SET);
-	diskname(name, disk_idx);
-	if ((f = fopen(name, "wb")) != NULL)
+	/* the same tile is already stored for another one */
+	if (diskshare(i, data, n, format, hash, etag))
+		pack_used[(int) net_provider[s]] += PACK_LENGTH(disk[i].etag, n) + PACK_TAG(i);
+	else if (pack_write(i, data, n, format, etag))
+	{
+		disk[i].hash = hash;
+		dedup_add(hash, disk[i].pack, disk[i].offset, PACK_LENGTH(disk[i].etag, n));
+		pack_used[(int) net_provider[s]] += PACK_LENGTH(disk[i].etag, n);
+	}
+	/* could not write it, forget the entry */
+	else
 	{
-		SDL_RWread(rw, buffer, 1, n);
-		fwrite(buffer, 1, n, f);
-		fclose(f);
+		diskindex_remove(i);
+		diskqueue_free(i);
+		disk[i].fetched = 0;
 	}
+	journal_write(i);
+	if (disk[i].fetched)
+		diskbudget(i);
+	disk_unlock();
+}
+
+/* the tile on disk is still valid, restart its lifetime */
+void touchdisk(int x, int y, int z, int s)
+{
+	int i;
+	disk_lock();
+	if ((i = indisk(x, y, z, s)) >= 0)
+		disk[i].fetched = time(NULL);
+	disk_unlock();
+}
+
+/* queue a conditional download if the tile on disk is too old */
+void refreshdisk(int i)
+{
+	char etag[100];
+	
+	if (time(NULL) - disk[i].fetched < DISK_MAXAGE) return;
 	
-	disk_idx = (disk_idx + 1) % config.cache_size;
+	disk_lock();
+	pack_etag(i, etag);
+	disk_unlock();
+	net_refresh(disk[i].x, disk[i].y, disk[i].z, disk[i].s, etag, disk[i].modified);
 }
 
-/* curl callback to save in memory */
-size_t curl_write(void *ptr, size_t size, size_t nb, void *stream)
+/* scale the tiles of the sources with another size to the size of the display */
+SDL_Surface *fittile(SDL_Surface *tile)
 {
-	SDL_RWops *rw = stream;
-	int t = nb * size;
-	rw->write(rw, ptr, size, nb);
-	return t;
+	SDL_Surface *scaled;
+	
+	if (tile == NULL || (tile->w == TILE_SIZE && tile->h == TILE_SIZE)) return tile;
+	scaled = zoomSurface(tile, (double) TILE_SIZE / tile->w, (double) TILE_SIZE / tile->h, 1);
+	SDL_FreeSurface(tile);
+	return scaled;
 }
 
-/* get the image on internet and return a buffer */
-SDL_RWops *getnet(int x, int y, int z, int s)
+/* header of the tiles saved decoded, followed by their pixels, LZ4 compressed or not */
+typedef struct
+{
+	unsigned short w, h, pitch, pad;
+	unsigned int rmask, gmask, bmask, amask;
+} pixels;
+
+/* returns the pixels of (tile) in (format), with their size in (n), or NULL
+ * they are in the format of the display, loading them is a copy
+ * the tiles with transparency (hybrid maps) are kept as images */
+char *tilepixels(SDL_Surface *tile, int format, int *n)
 {
-	char request[1024];
-	SDL_RWops *rw;
+	SDL_Surface *conv;
+	pixels p;
+	char *data;
+	int size;
 	
-	DEBUG("getnet(%d, %d, %d, %d)\n", x, y, z, s);
+	if (tile->format->Amask || tile->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA)) return NULL;
+	#ifndef HAVE_LZ4
+	if (format == PACK_LZ4) return NULL;
+	#endif
 	
-	switch (s)
+	if (screen != NULL && screen->format->BitsPerPixel == 32)
+		conv = SDL_CreateRGBSurface(SDL_SWSURFACE, tile->w, tile->h, 32, screen->format->Rmask, screen->format->Gmask, screen->format->Bmask, 0);
+	else
+		conv = SDL_CreateRGBSurface(SDL_SWSURFACE, tile->w, tile->h, 32, 0xff0000, 0xff00, 0xff, 0);
+	if (conv == NULL) return NULL;
+	SDL_BlitSurface(tile, NULL, conv, NULL);
+	
+	p.w = conv->w;
+	p.h = conv->h;
+	p.pitch = conv->pitch;
+	p.pad = 0;
+	p.rmask = conv->format->Rmask;
+	p.gmask = conv->format->Gmask;
+	p.bmask = conv->format->Bmask;
+	p.amask = conv->format->Amask;
+	size = conv->pitch * conv->h;
+	
+	#ifdef HAVE_LZ4
+	if (format == PACK_LZ4)
 	{
-		case GG_MAP:
-			sprintf(request, _url[s], ++balancing%4, x, y, z);
-			break;
-		case GG_SATELLITE:
-			sprintf(request, _url[s], ++balancing%4, x, y, z);
-			break;
-		case GG_HYBRID:
-		case GG_TERRAIN:
-			sprintf(request, _url[s], ++balancing%4, x, y, z);
-			break;
-		case VE_ROAD:
-		case VE_AERIAL:
-		case VE_HYBRID:
-		case VE_HILL:
-			sprintf(request, _url[s], VEtile(x, y, z));
-			break;
-		case YH_MAP:
-		case YH_SATELLITE:
-		case YH_HYBRID:
-			sprintf(request, _url[s], x, (int) pow(2, 16-z)-y-1, z+1);
-			break;
-		case OS_MAPNIK:
-                case OS_CLOUDMADE:
-		case OS_OPENCYCLEMAP:
-                case OS_OPENCYCLEMAPTRANS:
-			sprintf(request, _url[s], 17-z, x, y);
-			break;
-                case MQ_MAPQUEST:
-                case MQ_MAPQUESTAERIAL:
-			sprintf(request, _url[s], 17-z, x, y);
-			break;
-		case GG_MOON_APOLLO:
-		case GG_MOON_CLEMBW:
-		case GG_MOON_ELEVATION:
-			sprintf(request, _url[s], 17-z, x, (int) pow(2, 17-z)-y-1);
-			break;
-		case GG_MARS_ELEVATION:
-		case GG_MARS_VISIBLE:
-		case GG_MARS_INFRARED:
-			sprintf(request, _url[s], GGtile(x, y, z));
-			break;
-		case GG_SKY_VISIBLE:
-			sprintf(request, _url[s], x, y, 17-z);
-			break;
-		case GG_SKY_INFRARED:
-		case GG_SKY_MICROWAVE:
-		case GG_SKY_HISTORICAL:
-			sprintf(request, _url[s], 17-z, x, y);
-			break;
+		data = malloc(sizeof(pixels) + LZ4_compressBound(size));
+		size = LZ4_compress_default(conv->pixels, data + sizeof(pixels), size, LZ4_compressBound(size));
 	}
-        DEBUG("geturl('%s')\n", request);
-	rw = SDL_RWFromMem(response, BUFFER_SIZE);
-	
-	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, "PSP-Maps " VERSION);
-	curl_easy_setopt(curl, CURLOPT_URL, request);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, rw);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+	else
+	#endif
+	{
+		data = malloc(sizeof(pixels) + size);
+		memcpy(data + sizeof(pixels), conv->pixels, size);
+	}
+	memcpy(data, &p, sizeof(pixels));
+	*n = sizeof(pixels) + size;
+	SDL_FreeSurface(conv);
+	if (size <= 0)
+	{
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* returns the tile saved as pixels in (format), of (n) bytes, or NULL */
+SDL_Surface *pixelstile(char *data, int n, int format)
+{
+	SDL_Surface *tile;
+	pixels p;
+	int size;
 	
-	if (curl_easy_perform(curl) != 0)
-		/* if there was a network error, invalidate previous buffer */
-		response[0] = '\0';
+	/* the data may not be aligned in the pack */
+	if (n < sizeof(pixels)) return NULL;
+	memcpy(&p, data, sizeof(pixels));
+	tile = SDL_CreateRGBSurface(SDL_SWSURFACE, p.w, p.h, 32, p.rmask, p.gmask, p.bmask, p.amask);
+	if (tile == NULL) return NULL;
+	size = tile->pitch * tile->h;
+	data += sizeof(pixels);
+	n -= sizeof(pixels);
 	
-	return rw;
+	if (tile->pitch == p.pitch && format == PACK_PIXELS && n == size)
+		memcpy(tile->pixels, data, size);
+	#ifdef HAVE_LZ4
+	else if (tile->pitch == p.pitch && format == PACK_LZ4 && LZ4_decompress_safe(data, tile->pixels, n, size) == size);
+	#endif
+	else
+	{
+		SDL_FreeSurface(tile);
+		tile = NULL;
+	}
+	return tile;
 }
 
-/* return the tile from disk if available, or NULL */
+/* returns the tile from its (data) of (n) bytes in (format) */
+SDL_Surface *loadtile(char *data, int n, int format)
+{
+	if (format == PACK_IMAGE)
+		return IMG_Load_RW(SDL_RWFromConstMem(data, n), 1);
+	return pixelstile(data, n, format);
+}
+
+/* tiles the display could not look up, the disk cache was busy: they are tried again on the next display */
+int disk_busy = 0;
+
+/* return the tile from disk if available, or NULL
+ * the tile is decoded or copied straight from the pack
+ * the display does not wait while the disk cache is written, the tile is counted in disk_busy then */
 SDL_Surface *getdisk(int x, int y, int z, int s)
 {
-	int i;
-	char name[50];
+	SDL_Surface *tile = NULL;
+	char *data;
+	int i, n, format, copy;
 	DEBUG("getdisk(%d, %d, %d, %d)\n", x, y, z, s);
-	for (i = 0; i < config.cache_size; i++)
-		if (disk[i].x == x && disk[i].y == y && disk[i].z == z && disk[i].s == s)
-		{
-			diskname(name, i);
-			return IMG_Load(name);
-		}
-	return NULL;
+	
+	/* no disk cache */
+	if (!config.cache_size)
+		return NULL;
+	
+	/* a tile not written yet */
+	if (write_lock != NULL)
+	{
+		SDL_LockMutex(write_lock);
+		if ((i = write_find(x, y, z, s)) >= 0)
+			tile = loadtile(write_queue[i].data, write_queue[i].n, write_queue[i].format);
+		SDL_UnlockMutex(write_lock);
+		if (tile != NULL)
+			return fittile(tile);
+	}
+	
+	/* the index changes while the tiles are written */
+	if (!disk_trylock())
+	{
+		disk_busy++;
+		return NULL;
+	}
+	if ((i = indisk(x, y, z, s)) < 0)
+	{
+		disk_unlock();
+		return NULL;
+	}
+	refreshdisk(i);
+	if ((data = pack_data(i, &n, &format, &copy)) != NULL)
+		tile = loadtile(data, n, format);
+	if (tile != NULL)
+		warm_put(x, y, z, s, data, n, format);
+	if (copy) free(data);
+	if (tile != NULL)
+	{
+		diskqueue_hit(i);
+		disk_stats.hits++;
+		disktrace('g', x, y, z, s);
+	}
+	disk_unlock();
+	return fittile(tile);
 }
 
 /* return the tile from memory if available, or NULL */
@@ -227,17 +416,24 @@ SDL_Surface *getmemory(int x, int y, int z, int s)
 	return NULL;
 }
 
-/* downloads the image from Google for location (x,y,z) with mode (s) */
+/* return the tile for location (x,y,z) with mode (s) from the caches
+ * if it is not available yet, queue the download and return NULL */
 SDL_Surface* gettile(int x, int y, int z, int s)
 {
-	SDL_RWops *rw;
 	SDL_Surface *tile;
-	int n;
+	int busy = disk_busy;
 	
 	/* try memory cache */
 	if ((tile = getmemory(x, y, z, s)) != NULL)
 		return tile;
 	
+	/* try the tiles kept encoded in memory */
+	if ((tile = warm_get(x, y, z, s)) != NULL)
+	{
+		savememory(x, y, z, s, tile);
+		return tile;
+	}
+	
 	/* try disk cache */
 	if ((tile = getdisk(x, y, z, s)) != NULL)
 	{
@@ -245,28 +441,142 @@ SDL_Surface* gettile(int x, int y, int z, int s)
 		return tile;
 	}
 	
-	/* try internet */
-	rw = getnet(x, y, z, s);
+	/* it may be there, not ready yet */
+	if (disk_busy != busy)
+		return NULL;
 	
-	/* load the image */
-	n = SDL_RWtell(rw);
-	SDL_RWseek(rw, 0, SEEK_SET);
-	tile = IMG_Load_RW(rw, 0);
-	SDL_RWseek(rw, 0, SEEK_SET);
+	/* failed recently, show the n/a image until it is tried again */
+	if (net_failing(x, y, z, s) || !source_has(z, s))
+		return na;
 	
-	/* if there is no tile, copy the n/a image
-	 * I use a dummy call to zoomSurface to copy the surface
-	 * because I had issues with SDL_DisplayFormat() on PSP */
-	if (tile == NULL)
-		tile = zoomSurface(na, 1, 1, 0);
-	/* only save on disk if not n/a
-	 * to avoid filling the cache with wrong images
-	 * when we are offline */
-	else
-		savedisk(x, y, z, s, rw, n);
-	savememory(x, y, z, s, tile);
+	/* try internet */
+	net_request(x, y, z, s, PRIO_VISIBLE);
+	return NULL;
+}
+
+/* queue the download of a tile to the disk cache, if it is not there yet
+ * returns 1 if the tile is being downloaded */
+int cachetile(int x, int y, int z, int s, int prio)
+{
+	int i;
+	if (!config.cache_size) return 0;
+	if (getmemory(x, y, z, s) != NULL || writing(x, y, z, s)) return 0;
+	/* a sweep waits for the disk cache, the display tries again later */
+	if (prio == PRIO_BULK)
+		disk_lock();
+	else if (!disk_trylock())
+	{
+		disk_busy++;
+		return 0;
+	}
+	i = indisk(x, y, z, s);
+	disk_unlock();
+	if (i >= 0) return 0;
+	if (net_failing(x, y, z, s) || !source_has(z, s)) return 0;
+	net_request(x, y, z, s, prio);
+	return 1;
+}
+
+/* same for the current view, with the background of hybrid maps */
+int prefetch(int x, int y, int z, int prio)
+{
+	if (x < 0 || y < 0 || x >= 1 << (17-z) || y >= 1 << (17-z)) return 0;
 	
-	SDL_RWclose(rw);
+	/* special process for hybrid maps: get 2 images */
+	switch (s)
+	{
+		case GG_HYBRID:
+			cachetile(x, y, z, GG_SATELLITE, prio);
+			break;
+		case YH_HYBRID:
+			cachetile(x, y, z, YH_SATELLITE, prio);
+			break;
+	}
+	return cachetile(x, y, z, s, prio);
+}
+
+/* handle the tiles downloaded in background
+ * returns the number of tiles received */
+int receivetiles()
+{
+	SDL_Surface *tile;
+	job *j;
+	char *data;
+	int n = 0, size, keep;
 	
-	return tile;
+	while ((j = net_done()) != NULL)
+	{
+		if (j->cancel)
+		{
+			net_free(j);
+			continue;
+		}
+		
+		/* not modified since the tile was saved on disk */
+		if (j->ok && j->code == 304)
+		{
+			DEBUG("not modified(%d, %d, %d, %d)\n", j->x, j->y, j->z, j->s);
+			touchdisk(j->x, j->y, j->z, j->s);
+			net_forget(j->x, j->y, j->z, j->s);
+			net_free(j);
+			n++;
+			continue;
+		}
+		
+		/* load the image */
+		tile = NULL;
+		if (j->ok && j->buf.size)
+			tile = fittile(IMG_Load_RW(SDL_RWFromConstMem(j->buf.ptr, j->buf.size), 1));
+		
+		/* only save on disk if not n/a
+		 * to avoid filling the cache with wrong images
+		 * when we are offline */
+		if (tile != NULL)
+		{
+			/* the warm tier keeps the tiles of the display, and the new version of the ones it has */
+			keep = j->show || warm_find(j->x, j->y, j->z, j->s) >= 0;
+			/* decoded if set so, the next loads will be a copy */
+			if (config.disk_format != PACK_IMAGE && (data = tilepixels(tile, config.disk_format, &size)) != NULL)
+			{
+				savedisk(j->x, j->y, j->z, j->s, data, size, config.disk_format, j->etag, j->modified);
+				if (keep) warm_put(j->x, j->y, j->z, j->s, data, size, config.disk_format);
+				free(data);
+			}
+			else
+			{
+				savedisk(j->x, j->y, j->z, j->s, j->buf.ptr, j->buf.size, PACK_IMAGE, j->etag, j->modified);
+				if (keep) warm_put(j->x, j->y, j->z, j->s, j->buf.ptr, j->buf.size, PACK_IMAGE);
+			}
+			net_forget(j->x, j->y, j->z, j->s);
+			/* a tile on screen that was not on disk yet */
+			if (!j->refresh)
+			{
+				disktrace(j->show ? 'g' : 'p', j->x, j->y, j->z, j->s);
+				if (j->show) disk_stats.misses++;
+			}
+		}
+		else if (!j->refresh)
+			net_fail(j->x, j->y, j->z, j->s);
+		
+		/* a refreshed tile replaces the old one on screen
+		 * if the refresh failed, keep the old one */
+		if (j->refresh && !j->show)
+		{
+			if (tile && getmemory(j->x, j->y, j->z, j->s))
+				savememory(j->x, j->y, j->z, j->s, tile);
+			else
+				SDL_FreeSurface(tile);
+		}
+		/* if there is no tile, gettile() shows the shared n/a image
+		 * until the tile is tried again */
+		else if (!j->show || tile == NULL)
+			SDL_FreeSurface(tile);
+		else
+			savememory(j->x, j->y, j->z, j->s, tile);
+		
+		net_free(j);
+		n++;
+	}
+	
+	return n;
 }
@@ -0,0 +1,378 @@
+/* offline check of the disk cache (pspmaps --verify)
+ * the packs are read by several threads, every record is checked:
+ * its header, and the header and end of the image (or the size of the pixels)
+ * then the index is checked against what was found:
+ *   the entries of a missing or broken tile are dropped, a missing ETag of their own is forgotten
+ *   of two entries for the same tile, the oldest one is dropped
+ *   the records no entry uses (orphans) get a free entry if their tile is not cached,
+ *   as after a lost index
+ * at last the packs with dead records are compacted, the tiles of the previous versions moved to the packs */
+
+#define VERIFY_THREADS 4
+#define VERIFY_MAX_THREADS 32
+#define VERIFY_CHECKPOINT 8
+/* the own ETag of the entry (i) is in a pack with dead records */
+#define VERIFY_RETAG(i) (disk[i].tag && pack[disk[i].tag - 1].live < pack[disk[i].tag - 1].size)
+
+/* a record found in a pack */
+typedef struct
+{
+	int offset;
+	record r;
+	unsigned int hash;
+	char used;
+} found;
+
+struct
+{
+	found *records;
+	int num;
+} verify_pack[PACK_NUM];
+
+/* next pack to read, shared with the threads */
+int verify_next;
+SDL_mutex *verify_lock;
+
+struct
+{
+	long long bytes;
+	int records, broken;
+} verify_stats;
+
+/* does (data) of (n) bytes look like a whole tile in (format) */
+int verify_tile(char *data, int n, int format)
+{
+	unsigned char *d = (unsigned char *) data;
+	pixels p;
+	int i;
+
+	switch (format)
+	{
+		case PACK_IMAGE:
+			/* PNG: signature and header chunk first, end chunk last */
+			if (n >= 57 && !memcmp(d, "\x89PNG\r\n\x1a\n", 8))
+				return !memcmp(d + 12, "IHDR", 4) && !memcmp(d + n - 8, "IEND", 4);
+			/* JPEG: start of image, end of image at the end (some servers pad it) */
+			if (n >= 4 && d[0] == 0xff && d[1] == 0xd8)
+			{
+				for (i = n - 2; i >= 2 && i >= n - 32; i--)
+					if (d[i] == 0xff && d[i + 1] == 0xd9)
+						return 1;
+				return 0;
+			}
+			/* GIF: trailer */
+			if (n >= 14 && !memcmp(d, "GIF8", 4))
+				return d[n - 1] == 0x3b;
+			return 0;
+		case PACK_PIXELS:
+		case PACK_LZ4:
+			if (n < sizeof(pixels)) return 0;
+			memcpy(&p, data, sizeof(pixels));
+			if (!p.w || !p.h || p.pitch < p.w * 4)
+				return 0;
+			if (format == PACK_PIXELS)
+				return n == sizeof(pixels) + p.pitch * p.h;
+			#ifdef HAVE_LZ4
+			{
+				char *buf = malloc(p.pitch * p.h);
+				i = LZ4_decompress_safe(data + sizeof(pixels), buf, n - sizeof(pixels), p.pitch * p.h) == p.pitch * p.h;
+				free(buf);
+				return i;
+			}
+			#else
+			return n > sizeof(pixels);
+			#endif
+	}
+	return 0;
+}
+
+/* read the records of the pack (p) */
+void verify_read(int p)
+{
+	FILE *f;
+	record r;
+	char name[50], *data = NULL;
+	int offset = 0, length, size = 0, broken = 0, num = 0;
+
+	packname(name, p);
+	if ((f = fopen(name, "rb")) == NULL)
+		return;
+	while (offset + sizeof(record) <= pack[p].size && fread(&r, sizeof(record), 1, f) == 1)
+	{
+		length = PACK_LENGTH(r.etag, r.size);
+		if (r.magic != PACK_MAGIC || r.size > pack[p].size || r.etag < 0 || r.etag >= 100 || r.format < 0 || r.format >= PACK_FORMATS
+			|| offset + length > pack[p].size)
+		{
+			/* a torn write: look for the next header */
+			offset += 4;
+			fseek(f, offset, SEEK_SET);
+			continue;
+		}
+		if (length > size)
+			data = realloc(data, size = length);
+		if (fread(data, 1, length - sizeof(record), f) != length - sizeof(record))
+			break;
+		/* without data: the own ETag of a tile that shares a record, see pack_tag() */
+		if (!r.size || verify_tile(data + r.etag, r.size, r.format))
+		{
+			if (num % 1024 == 0)
+				verify_pack[p].records = realloc(verify_pack[p].records, sizeof(found) * (num + 1024));
+			verify_pack[p].records[num].offset = offset;
+			verify_pack[p].records[num].r = r;
+			verify_pack[p].records[num].hash = dedup_sum(data + r.etag, r.size);
+			verify_pack[p].records[num].used = 0;
+			num++;
+		}
+		else
+			broken++;
+		offset += length;
+	}
+	fclose(f);
+	free(data);
+	verify_pack[p].num = num;
+
+	SDL_LockMutex(verify_lock);
+	verify_stats.bytes += pack[p].size;
+	verify_stats.records += num;
+	verify_stats.broken += broken;
+	SDL_UnlockMutex(verify_lock);
+}
+
+int verify_worker(void *unused)
+{
+	int p;
+
+	for (;;)
+	{
+		SDL_LockMutex(verify_lock);
+		while (verify_next < PACK_NUM && (!pack[verify_next].size || pack[verify_next].retired))
+			verify_next++;
+		p = verify_next++;
+		SDL_UnlockMutex(verify_lock);
+		if (p >= PACK_NUM)
+			return 0;
+		verify_read(p);
+	}
+}
+
+/* returns the record of the pack (p) at (offset), or NULL */
+found *verify_find(int p, int offset)
+{
+	int low = 0, high = verify_pack[p].num - 1, mid;
+
+	while (low <= high)
+	{
+		mid = (low + high) / 2;
+		if (verify_pack[p].records[mid].offset == offset)
+			return &verify_pack[p].records[mid];
+		if (verify_pack[p].records[mid].offset < offset)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return NULL;
+}
+
+/* the most recent orphans first */
+int verify_cmp(const void *a, const void *b)
+{
+	unsigned int fa = (*(found **) a)->r.fetched, fb = (*(found **) b)->r.fetched;
+	return fa > fb ? -1 : fa < fb;
+}
+
+/* the entries sorted by pack, then offset */
+int verify_order(const void *a, const void *b)
+{
+	struct _disk *da = &disk[*(int *) a], *db = &disk[*(int *) b];
+	if (da->pack != db->pack)
+		return da->pack - db->pack;
+	return da->offset - db->offset;
+}
+
+/* forget the tile of the entry (i) */
+void verify_drop(int i)
+{
+	if (disk[i].pack == PACK_LEGACY)
+		pack_unlink(i);
+	disk[i].fetched = 0;
+	disk[i].pack = PACK_NONE;
+	disk[i].tag = 0;
+	disk[i].hash = 0;
+}
+
+/* check and compact the disk cache with (threads) threads */
+void verify(int threads)
+{
+	SDL_Thread *thread[VERIFY_MAX_THREADS];
+	found *r, **orphans;
+	char *data;
+	int *order, i, j, k, p, t, n, format, copy, bad = 0, duplicates = 0, adopted = 0, orphans_num = 0, moved = 0, freed = 0;
+
+	if (threads < 1) threads = 1;
+	if (threads > VERIFY_MAX_THREADS) threads = VERIFY_MAX_THREADS;
+
+	/* the compaction is done here, without the worker */
+	pack_quit();
+	pack_close();
+	/* and without the other processes, the packs are rewritten */
+	disk_lock();
+	if (index_others())
+	{
+		printf("verify: the cache is used by another process\n");
+		disk_unlock();
+		return;
+	}
+
+	/* read every pack */
+	t = SDL_GetTicks();
+	verify_lock = SDL_CreateMutex();
+	verify_next = 0;
+	for (i = 0; i < threads; i++)
+		thread[i] = SDL_CreateThread(verify_worker, NULL);
+	for (i = 0; i < threads; i++)
+		SDL_WaitThread(thread[i], NULL);
+	SDL_DestroyMutex(verify_lock);
+	t = SDL_GetTicks() - t;
+	printf("verify: %d records, %d broken, %.1f MB in %.2f s, %.1f MB/s with %d threads\n",
+		verify_stats.records, verify_stats.broken, verify_stats.bytes / 1048576.0, t / 1000.0,
+		verify_stats.bytes / 1048576.0 * 1000 / (t ? t : 1), threads);
+
+	/* the entries must point to a good record of their tile */
+	for (i = 0; i < config.cache_size; i++)
+	{
+		if (!disk[i].fetched)
+			continue;
+		if (disk[i].pack == PACK_LEGACY)
+		{
+			if ((data = pack_data(i, &n, &format, &copy)) == NULL || !verify_tile(data, n, format))
+			{
+				verify_drop(i);
+				bad++;
+			}
+			free(data);
+			continue;
+		}
+		r = disk[i].pack >= 0 && disk[i].pack < PACK_NUM ? verify_find(disk[i].pack, disk[i].offset) : NULL;
+		/* a record of another tile with the same content is shared, see dedup.c */
+		if (r == NULL || r->r.size != disk[i].size || r->r.etag != disk[i].etag || (disk[i].hash && disk[i].hash != r->hash)
+			|| ((r->used || r->r.x != disk[i].x || r->r.y != disk[i].y || r->r.z != disk[i].z || r->r.s != disk[i].s) && !disk[i].hash))
+		{
+			verify_drop(i);
+			bad++;
+		}
+		else
+			r->used = 1;
+		/* and to the record of their own ETag */
+		if (disk[i].fetched && disk[i].tag)
+		{
+			r = disk[i].tag > 0 && disk[i].tag <= PACK_NUM ? verify_find(disk[i].tag - 1, disk[i].tag_offset) : NULL;
+			if (r == NULL || r->r.size || r->r.etag != disk[i].tag_length || r->used
+				|| r->r.x != disk[i].x || r->r.y != disk[i].y || r->r.z != disk[i].z || r->r.s != disk[i].s)
+				disk[i].tag = 0;
+			else
+				r->used = 1;
+		}
+	}
+
+	/* one entry per tile, the most recent one */
+	diskindex_build();
+	for (i = 0; i < config.cache_size; i++)
+		if (disk[i].fetched && (j = indisk(disk[i].x, disk[i].y, disk[i].z, disk[i].s)) != i)
+		{
+			if (disk[i].fetched > disk[j].fetched)
+			{
+				diskindex_remove(j);
+				diskindex_add(i);
+				verify_drop(j);
+			}
+			else
+				verify_drop(i);
+			duplicates++;
+		}
+
+	/* the orphans of tiles not cached get the free entries */
+	for (p = 0; p < PACK_NUM; p++)
+		for (k = 0; k < verify_pack[p].num; k++)
+			orphans_num += !verify_pack[p].records[k].used;
+	orphans = malloc(sizeof(found *) * (orphans_num + 1));
+	for (p = 0, n = 0; p < PACK_NUM; p++)
+		for (k = 0; k < verify_pack[p].num; k++)
+			if (!verify_pack[p].records[k].used)
+			{
+				/* remember the pack in the magic of the record, it is not needed any more */
+				verify_pack[p].records[k].r.magic = p;
+				orphans[n++] = &verify_pack[p].records[k];
+			}
+	qsort(orphans, orphans_num, sizeof(found *), verify_cmp);
+	for (i = 0, k = 0; k < orphans_num; k++)
+	{
+		r = orphans[k];
+		if (!r->r.size || indisk(r->r.x, r->r.y, r->r.z, r->r.s) >= 0)
+			continue;
+		while (i < config.cache_size && disk[i].fetched)
+			i++;
+		if (i == config.cache_size)
+			break;
+		disk[i].x = r->r.x;
+		disk[i].y = r->r.y;
+		disk[i].z = r->r.z;
+		disk[i].s = r->r.s;
+		disk[i].etag = r->r.etag;
+		disk[i].hot = DISK_COLD;
+		disk[i].fetched = disk[i].used = r->r.fetched;
+		disk[i].modified = r->r.modified;
+		disk[i].pack = r->r.magic;
+		disk[i].tag = 0;
+		disk[i].offset = r->offset;
+		disk[i].size = r->r.size;
+		disk[i].hash = r->hash;
+		diskindex_add(i);
+		adopted++;
+	}
+	free(orphans);
+	printf("verify: %d bad entries, %d duplicates, %d unused records, %d of them cached again\n", bad, duplicates, orphans_num, adopted);
+	pack_count();
+	printf("verify: %d tiles in %d shared records, %.2fx dedup\n", dedup_refs, dedup_blobs, dedup_blobs ? (float) dedup_refs / dedup_blobs : 1.0);
+
+	/* compact the packs with dead records, in the order of the records */
+	t = SDL_GetTicks();
+	order = malloc(sizeof(int) * (config.cache_size + 1));
+	for (i = 0, n = 0; i < config.cache_size; i++)
+		if (disk[i].fetched && (disk[i].pack == PACK_LEGACY || (disk[i].pack >= 0 && disk[i].pack < PACK_NUM
+			&& pack[disk[i].pack].live < pack[disk[i].pack].size) || VERIFY_RETAG(i)))
+			order[n++] = i;
+	qsort(order, n, sizeof(int), verify_order);
+	for (k = 0; k < n; k++)
+	{
+		p = disk[order[k]].pack;
+		if (p == PACK_LEGACY || pack[p].live < pack[p].size)
+			pack_move(order[k]);
+		moved += disk[order[k]].pack != p;
+		if (VERIFY_RETAG(order[k]))
+			pack_retag(order[k]);
+		/* the last record of the pack moved, it can go */
+		if (p >= 0 && !pack[p].live && (k + 1 == n || disk[order[k + 1]].pack != p))
+		{
+			pack_retire(p);
+			/* delete them before the disk fills up */
+			if (++freed % VERIFY_CHECKPOINT == 0)
+				journal_checkpoint();
+		}
+	}
+	free(order);
+	/* the packs with only dead records */
+	for (p = 0; p < PACK_NUM; p++)
+		if (pack[p].size && !pack[p].live && !pack[p].retired && p != pack_cur)
+		{
+			pack_retire(p);
+			freed++;
+		}
+	diskqueue_build();
+	journal_checkpoint();
+	disk_unlock();
+	t = SDL_GetTicks() - t;
+	printf("verify: %d tiles moved, %d packs freed in %.2f s\n", moved, freed, t / 1000.0);
+
+	for (p = 0; p < PACK_NUM; p++)
+		free(verify_pack[p].records);
+}
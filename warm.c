@@ -0,0 +1,226 @@
+/* warm tier of the tile caches, between the decoded tiles of memory[] and the disk cache:
+ * the tiles used recently are kept encoded as on disk (images, or pixels), within config.warm_budget MB,
+ * and decoded again when the display comes back to them, without the packs or the index
+ * a tile read from disk or downloaded for the display comes here, a tile leaving memory[] stays here
+ * (compressed with LZ4 if it was not), the least recently used ones go first
+ * only used by the display thread */
+
+#if defined(_PSP_FW_VERSION) || defined(GP2X)
+#define WARM_BUDGET 4
+#define MAX_WARMBUDGET 32
+#else
+#define WARM_BUDGET 64
+#define MAX_WARMBUDGET 4096
+#endif
+/* smallest tile expected, the number of entries follows from the budget */
+#define WARM_TILE 4096
+
+struct _warm
+{
+	int x, y;
+	char z, s, format;
+	int n;
+	char *data;
+	/* least recently used list, -1 at the ends, or the next free entry */
+	int prev, next;
+} *warm = NULL;
+
+/* index by tile: open addressing with linear probing, a slot holds the entry + 1 (see tile.c) */
+int *warm_table = NULL;
+int warm_mask = 0, warm_entries = 0, warm_head = -1, warm_tail = -1, warm_free = -1;
+long long warm_bytes = 0;
+
+/* where the display found its tiles again */
+struct
+{
+	int hits, misses, demoted;
+} warm_stats;
+
+int warm_slot(int i)
+{
+	return tilehash(tilekey(warm[i].x, warm[i].y, warm[i].z, warm[i].s)) & warm_mask;
+}
+
+/* returns the entry of the tile, or -1 */
+int warm_find(int x, int y, int z, int s)
+{
+	int h = tilehash(tilekey(x, y, z, s)) & warm_mask, i;
+
+	if (warm_table == NULL) return -1;
+	while ((i = warm_table[h]) != 0)
+	{
+		i--;
+		if (warm[i].x == x && warm[i].y == y && warm[i].z == z && warm[i].s == s)
+			return i;
+		h = (h + 1) & warm_mask;
+	}
+	return -1;
+}
+
+void warm_unlink(int i)
+{
+	if (warm[i].prev >= 0) warm[warm[i].prev].next = warm[i].next;
+	else warm_head = warm[i].next;
+	if (warm[i].next >= 0) warm[warm[i].next].prev = warm[i].prev;
+	else warm_tail = warm[i].prev;
+}
+
+/* the entry (i) was just used */
+void warm_front(int i)
+{
+	warm[i].prev = -1;
+	warm[i].next = warm_head;
+	if (warm_head >= 0) warm[warm_head].prev = i;
+	else warm_tail = i;
+	warm_head = i;
+}
+
+/* forget the entry (i), the next entries of its probe chain are moved back (see diskindex_remove()) */
+void warm_drop(int i)
+{
+	int h = warm_slot(i), j, k;
+
+	while (warm_table[h] != i + 1)
+		h = (h + 1) & warm_mask;
+	for (j = (h + 1) & warm_mask; warm_table[j]; j = (j + 1) & warm_mask)
+	{
+		k = warm_slot(warm_table[j] - 1);
+		if (j > h ? (k <= h || k > j) : (k <= h && k > j))
+		{
+			warm_table[h] = warm_table[j];
+			h = j;
+		}
+	}
+	warm_table[h] = 0;
+
+	warm_unlink(i);
+	warm_bytes -= warm[i].n;
+	free(warm[i].data);
+	warm[i].data = NULL;
+	warm[i].next = warm_free;
+	warm_free = i;
+}
+
+/* keep the tile from its (data) of (n) bytes in (format), replacing the previous version if any */
+void warm_put(int x, int y, int z, int s, char *data, int n, int format)
+{
+	long long budget = config.warm_budget * 1048576LL;
+	char *copy;
+	int i, h;
+
+	if (warm == NULL || n <= 0 || n > budget / 4 || (copy = malloc(n)) == NULL)
+		return;
+	memcpy(copy, data, n);
+	if ((i = warm_find(x, y, z, s)) >= 0)
+		warm_drop(i);
+	/* the oldest tiles make room */
+	while (warm_tail >= 0 && (warm_free < 0 || warm_bytes + n > budget))
+		warm_drop(warm_tail);
+
+	i = warm_free;
+	warm_free = warm[i].next;
+	warm[i].x = x;
+	warm[i].y = y;
+	warm[i].z = z;
+	warm[i].s = s;
+	warm[i].format = format;
+	warm[i].n = n;
+	warm[i].data = copy;
+	warm_bytes += n;
+	for (h = warm_slot(i); warm_table[h]; h = (h + 1) & warm_mask);
+	warm_table[h] = i + 1;
+	warm_front(i);
+}
+
+/* return the tile decoded from the warm tier, or NULL */
+SDL_Surface *warm_get(int x, int y, int z, int s)
+{
+	SDL_Surface *tile;
+	int i;
+
+	if ((i = warm_find(x, y, z, s)) < 0)
+	{
+		warm_stats.misses++;
+		return NULL;
+	}
+	if ((tile = loadtile(warm[i].data, warm[i].n, warm[i].format)) == NULL)
+	{
+		warm_drop(i);
+		return NULL;
+	}
+	warm_unlink(i);
+	warm_front(i);
+	warm_stats.hits++;
+	return fittile(tile);
+}
+
+/* the decoded (tile) leaves memory[], it stays in the warm tier */
+void warm_keep(int x, int y, int z, int s, SDL_Surface *tile)
+{
+	#ifdef HAVE_LZ4
+	char *data;
+	int n;
+	#endif
+	int i;
+
+	if (warm == NULL || tile == NULL || tile == na)
+		return;
+	if ((i = warm_find(x, y, z, s)) >= 0)
+	{
+		/* used until now */
+		warm_unlink(i);
+		warm_front(i);
+		return;
+	}
+	#ifdef HAVE_LZ4
+	/* not read from disk nor downloaded: compressed now, a tile with transparency is not kept */
+	if ((data = tilepixels(tile, PACK_LZ4, &n)) != NULL)
+	{
+		warm_put(x, y, z, s, data, n, PACK_LZ4);
+		warm_stats.demoted++;
+		free(data);
+	}
+	#endif
+}
+
+/* forget the warm tier */
+void warm_quit()
+{
+	int i;
+
+	if (warm != NULL)
+		for (i = 0; i < warm_entries; i++)
+			free(warm[i].data);
+	free(warm);
+	free(warm_table);
+	warm = NULL;
+	warm_table = NULL;
+	warm_head = warm_tail = warm_free = -1;
+	warm_entries = 0;
+	warm_bytes = 0;
+}
+
+/* start the warm tier for config.warm_budget, empty */
+void warm_init()
+{
+	int i, size = 16;
+
+	warm_quit();
+	if (!config.warm_budget)
+		return;
+	warm_entries = config.warm_budget * (1048576 / WARM_TILE);
+	while (size < warm_entries * 2) size *= 2;
+	warm = calloc(warm_entries, sizeof(struct _warm));
+	warm_table = calloc(size, sizeof(int));
+	warm_mask = size - 1;
+	if (warm == NULL || warm_table == NULL)
+	{
+		warm_quit();
+		return;
+	}
+	for (i = warm_entries - 1; i >= 0; i--)
+	{
+		warm[i].next = warm_free;
+		warm_free = i;
+	}
+}
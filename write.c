@@ -0,0 +1,183 @@
+/* write-behind queue of the disk cache: savedisk() only copies the tile in the queue,
+ * a thread writes the queued tiles to the packs (writedisk() in tile.c)
+ * the queue is bounded in tiles and in bytes: when it is full, the display drops the tile
+ * (it is still in the memory cache, and downloaded again later) while the command line modes wait
+ * a queued tile is found by getdisk() until it is written, and quit() writes them all
+ * the thread holds the disk cache while it writes, syncs and checkpoints: the display only tries it
+ * (disk_trylock()) and shows the tile on a next display if it is busy */
+
+#define WRITE_QUEUE 64
+#if defined(_PSP_FW_VERSION) || defined(GP2X)
+#define WRITE_BYTES (2 * 1024 * 1024)
+#else
+#define WRITE_BYTES (16 * 1024 * 1024)
+#endif
+
+/* a tile to write, with what savedisk() needs */
+typedef struct
+{
+	int x, y;
+	char z, s, format;
+	char etag[100];
+	unsigned int modified;
+	char *data;
+	int n;
+} pending;
+
+/* ring of the queued tiles, the oldest at write_head */
+pending write_queue[WRITE_QUEUE];
+int write_head = 0, write_num = 0, write_bytes = 0, write_stop = 0;
+SDL_mutex *write_lock = NULL;
+SDL_cond *write_cond, *write_room;
+SDL_Thread *write_thread = NULL;
+
+/* wait for room in the queue instead of dropping tiles, without display */
+int write_wait = 0;
+
+struct
+{
+	int written, dropped, batches;
+} write_stats;
+
+/* returns the position in the queue of the tile, or -1, the write lock must be held
+ * the most recent one if it is queued twice */
+int write_find(int x, int y, int z, int s)
+{
+	int k;
+	pending *p;
+
+	for (k = write_num - 1; k >= 0; k--)
+	{
+		p = &write_queue[(write_head + k) % WRITE_QUEUE];
+		if (p->x == x && p->y == y && p->z == z && p->s == s)
+			return (write_head + k) % WRITE_QUEUE;
+	}
+	return -1;
+}
+
+/* is the tile waiting to be written */
+int writing(int x, int y, int z, int s)
+{
+	int k;
+
+	if (write_lock == NULL) return 0;
+	SDL_LockMutex(write_lock);
+	k = write_find(x, y, z, s);
+	SDL_UnlockMutex(write_lock);
+	return k >= 0;
+}
+
+/* save tile in disk cache, with its HTTP validators
+ * (data) is the downloaded image, or pixels in (format), it is copied */
+void savedisk(int x, int y, int z, int s, char *data, int n, int format, char *etag, unsigned int modified)
+{
+	pending *p;
+
+	if (!config.cache_size) return;
+
+	if (data == NULL)
+	{
+		printf("warning: savedisk(NULL)!\n");
+		return;
+	}
+
+	/* no thread: write it now */
+	if (write_thread == NULL)
+	{
+		writedisk(x, y, z, s, data, n, format, etag, modified);
+		return;
+	}
+
+	SDL_LockMutex(write_lock);
+	while (write_num == WRITE_QUEUE || (write_num && write_bytes + n > WRITE_BYTES))
+	{
+		if (!write_wait)
+		{
+			DEBUG("savedisk(%d, %d, %d, %d): queue full\n", x, y, z, s);
+			write_stats.dropped++;
+			SDL_UnlockMutex(write_lock);
+			return;
+		}
+		SDL_CondWait(write_room, write_lock);
+	}
+	p = &write_queue[(write_head + write_num) % WRITE_QUEUE];
+	p->x = x;
+	p->y = y;
+	p->z = z;
+	p->s = s;
+	p->format = format;
+	strncpy(p->etag, etag, sizeof(p->etag) - 1);
+	p->etag[sizeof(p->etag) - 1] = '\0';
+	p->modified = modified;
+	p->data = malloc(n);
+	memcpy(p->data, data, n);
+	p->n = n;
+	write_num++;
+	write_bytes += n;
+	SDL_CondSignal(write_cond);
+	SDL_UnlockMutex(write_lock);
+}
+
+/* write the queued tiles, all of those queued at once in a batch
+ * they stay in the queue while they are written, for getdisk() */
+int write_worker(void *unused)
+{
+	pending *p;
+	int k, num;
+
+	SDL_LockMutex(write_lock);
+	for (;;)
+	{
+		while (!write_num && !write_stop)
+			SDL_CondWait(write_cond, write_lock);
+		if (!write_num)
+			break;
+		num = write_num;
+		SDL_UnlockMutex(write_lock);
+
+		/* savedisk() only adds tiles after these ones */
+		for (k = 0; k < num; k++)
+		{
+			p = &write_queue[(write_head + k) % WRITE_QUEUE];
+			writedisk(p->x, p->y, p->z, p->s, p->data, p->n, p->format, p->etag, p->modified);
+		}
+
+		SDL_LockMutex(write_lock);
+		for (k = 0; k < num; k++)
+		{
+			p = &write_queue[write_head];
+			write_bytes -= p->n;
+			free(p->data);
+			write_head = (write_head + 1) % WRITE_QUEUE;
+		}
+		write_num -= num;
+		write_stats.written += num;
+		write_stats.batches++;
+		SDL_CondBroadcast(write_room);
+	}
+	SDL_UnlockMutex(write_lock);
+	return 0;
+}
+
+/* start the writes in background, once the packs are found */
+void write_init()
+{
+	write_lock = SDL_CreateMutex();
+	write_cond = SDL_CreateCond();
+	write_room = SDL_CreateCond();
+	write_thread = SDL_CreateThread(write_worker, NULL);
+}
+
+/* write the queued tiles and stop, before the packs are closed */
+void write_quit()
+{
+	if (write_thread == NULL) return;
+
+	SDL_LockMutex(write_lock);
+	write_stop = 1;
+	SDL_CondSignal(write_cond);
+	SDL_UnlockMutex(write_lock);
+	SDL_WaitThread(write_thread, NULL);
+	write_thread = NULL;
+	DEBUG("write: %d tiles in %d batches, %d dropped\n", write_stats.written, write_stats.batches, write_stats.dropped);
+}